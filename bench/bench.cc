@@ -0,0 +1,246 @@
+//
+//  bench.cc
+//
+//  Copyright (c) 2022 Yuji Hirose. All rights reserved.
+//  MIT License
+//
+
+#include <atomic>
+#include <benchmark/benchmark.h>
+#include <cstdlib>
+#if defined(_WIN32)
+#include <malloc.h>
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
+#include <fstream>
+#include <new>
+#include <peglib.h>
+#include <sstream>
+
+using namespace std;
+
+// Live and peak heap bytes, counted by the replaced global allocator below
+static atomic<size_t> heap_bytes{0};
+static atomic<size_t> heap_peak{0};
+
+static size_t allocated_size(void *p) {
+#if defined(_WIN32)
+  return _msize(p);
+#elif defined(__APPLE__)
+  return malloc_size(p);
+#else
+  return malloc_usable_size(p);
+#endif
+}
+
+void *operator new(size_t size) {
+  auto p = malloc(size ? size : 1);
+  if (!p) { throw bad_alloc(); }
+  auto bytes = heap_bytes.fetch_add(allocated_size(p)) + allocated_size(p);
+  auto peak = heap_peak.load();
+  while (bytes > peak && !heap_peak.compare_exchange_weak(peak, bytes)) {}
+  return p;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+// GCC mistakes `free` of memory from the replaced `operator new` for a bug.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void *p) noexcept {
+  if (!p) { return; }
+  heap_bytes.fetch_sub(allocated_size(p));
+  free(p);
+}
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+void operator delete[](void *p) noexcept { operator delete(p); }
+void operator delete(void *p, size_t) noexcept { operator delete(p); }
+void operator delete[](void *p, size_t) noexcept { operator delete(p); }
+
+static string grammar_dir = PEGLIB_GRAMMAR_DIR;
+static size_t input_mb = 4;
+
+static string read_file(const string &path) {
+  ifstream ifs(path, ios::in | ios::binary);
+  if (ifs.fail()) {
+    cerr << "can't open " << path << endl;
+    exit(1);
+  }
+  stringstream ss;
+  ss << ifs.rdbuf();
+  return ss.str();
+}
+
+/*
+ * Inputs
+ */
+
+static string make_json() {
+  string s = "[\n";
+  for (size_t i = 0; s.size() < input_mb * 1024 * 1024; i++) {
+    if (i) { s += ",\n"; }
+    s += "  {\"id\": " + to_string(i) + ", \"name\": \"item\\u0020" +
+         to_string(i) + "\", \"price\": " + to_string(i % 1000) +
+         ".25e-1, \"tags\": [\"a\", \"b\", null, true, false], "
+         "\"nested\": {\"x\": -1, \"y\": [1, 2, 3]}}";
+  }
+  s += "\n]\n";
+  return s;
+}
+
+static string make_csv() {
+  string s = "id,name,comment\n";
+  for (size_t i = 0; s.size() < input_mb * 1024 * 1024; i++) {
+    s += to_string(i) + ",item " + to_string(i) +
+         ",\"quoted, with \"\"escapes\"\"\r\nand a line break\"\n";
+  }
+  return s;
+}
+
+static string make_peg() {
+  string sample;
+  for (auto name : {"cpp-peglib.peg", "json.peg", "csv.peg", "pl0.peg"}) {
+    sample += read_file(grammar_dir + "/" + name) + "\n";
+  }
+  string s;
+  while (s.size() < input_mb * 1024 * 1024) {
+    s += sample;
+  }
+  return s;
+}
+
+static string make_pl0() {
+  string s = "CONST m = 7, n = 85;\nVAR x, y, z;\n";
+  for (size_t i = 0; s.size() < input_mb * 1024 * 1024; i++) {
+    auto id = to_string(i);
+    s += "PROCEDURE p" + id + ";\nVAR a, b;\nBEGIN\n  a := x + " + id +
+         " * (y - 3);\n  IF a > 10 THEN b := a / 2;\n"
+         "  WHILE a > 0 DO BEGIN a := a - 1; write a END\nEND;\n";
+  }
+  s += "BEGIN\n  x := m;\n  y := n;\n  CALL p0\nEND.\n";
+  return s;
+}
+
+/*
+ * Benchmarks
+ */
+
+enum class Mode { Plain, Lowered, Packrat, Ast, AstOpt };
+
+static void count_peak(benchmark::State &state, size_t base) {
+  state.counters["peak_bytes"] =
+      benchmark::Counter(static_cast<double>(heap_peak.load() - base),
+                         benchmark::Counter::kAvgThreads);
+}
+
+static void bench_load(benchmark::State &state, const string &grammar) {
+  auto base = heap_bytes.load();
+  heap_peak = base;
+  for (auto _ : state) {
+    peg::parser parser;
+    parser.set_logger(peg::Log());
+    benchmark::DoNotOptimize(parser.load_grammar(grammar));
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(grammar.size()));
+  count_peak(state, base);
+}
+
+static void bench_parse(benchmark::State &state, const string &grammar,
+                        const string &input, Mode mode) {
+  peg::parser parser(grammar);
+  if (!parser) {
+    state.SkipWithError("can't load the grammar");
+    return;
+  }
+  if (mode == Mode::Lowered) { parser.lower_grammar(); }
+  if (mode == Mode::Packrat) { parser.enable_packrat_parsing(); }
+  if (mode == Mode::Ast) { parser.enable_ast(); }
+  if (mode == Mode::AstOpt) { parser.enable_optimized_ast(); }
+  parser.freeze();
+
+  auto base = heap_bytes.load();
+  heap_peak = base;
+  for (auto _ : state) {
+    bool ret;
+    if (mode == Mode::Ast || mode == Mode::AstOpt) {
+      shared_ptr<peg::Ast> ast;
+      ret = parser.parse(input, ast);
+      benchmark::DoNotOptimize(ast);
+    } else {
+      ret = parser.parse(input);
+    }
+    if (!ret) {
+      state.SkipWithError("can't parse the input");
+      return;
+    }
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) *
+                          static_cast<int64_t>(input.size()));
+  count_peak(state, base);
+}
+
+int main(int argc, char **argv) {
+  benchmark::Initialize(&argc, argv);
+  for (auto i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--input-mb" && i + 1 < argc) {
+      input_mb = static_cast<size_t>(atoi(argv[++i]));
+    } else if (arg == "--grammar-dir" && i + 1 < argc) {
+      grammar_dir = argv[++i];
+    } else {
+      cerr << "usage: peglib-bench [--input-mb n] [--grammar-dir dir] "
+              "[benchmark options]"
+           << endl;
+      return 1;
+    }
+  }
+
+  struct Suite {
+    const char *name;
+    string (*make_input)();
+  };
+  static const Suite suites[] = {{"json", make_json},
+                                 {"csv", make_csv},
+                                 {"cpp-peglib", make_peg},
+                                 {"pl0", make_pl0}};
+  static const pair<const char *, Mode> modes[] = {{"plain", Mode::Plain},
+                                                   {"lowered", Mode::Lowered},
+                                                   {"packrat", Mode::Packrat},
+                                                   {"ast", Mode::Ast},
+                                                   {"ast_opt", Mode::AstOpt}};
+
+  // The inputs live until the end of main, like the registered benchmarks.
+  vector<unique_ptr<pair<string, string>>> data;
+  for (const auto &suite : suites) {
+    auto grammar = read_file(grammar_dir + "/" + suite.name + ".peg");
+    data.push_back(
+        make_unique<pair<string, string>>(grammar, suite.make_input()));
+    const auto &[g, input] = *data.back();
+
+    benchmark::RegisterBenchmark((string("load/") + suite.name).c_str(),
+                                 [&g = g](benchmark::State &state) {
+                                   bench_load(state, g);
+                                 });
+    for (const auto &[mode_name, mode] : modes) {
+      benchmark::RegisterBenchmark(
+          (string("parse/") + suite.name + "/" + mode_name).c_str(),
+          [&g = g, &input = input, mode = mode](benchmark::State &state) {
+            bench_parse(state, g, input, mode);
+          })
+          ->Unit(benchmark::kMillisecond);
+    }
+  }
+
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
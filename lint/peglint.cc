@@ -43,6 +43,11 @@ int main(int argc, const char **argv) {
   auto opt_trace = false;
   auto opt_verbose = false;
   auto opt_profile = false;
+  auto opt_emit_cpp = false;
+  auto opt_perf_report = false;
+  auto opt_compile = false;
+  const char *output_path = nullptr;
+  std::string emit_cpp_name = "peg";
   vector<const char *> path_list;
 
   auto argi = 1;
@@ -72,12 +77,21 @@ int main(int argc, const char **argv) {
       opt_profile = true;
     } else if (string("--verbose") == arg) {
       opt_verbose = true;
+    } else if (string("--perf-report") == arg) {
+      opt_perf_report = true;
+    } else if (string("--compile") == arg) {
+      opt_compile = true;
+    } else if (string("-o") == arg) {
+      if (argi < argc) { output_path = argv[argi++]; }
+    } else if (string("--emit-cpp") == arg) {
+      opt_emit_cpp = true;
+      if (argi < argc) { emit_cpp_name = argv[argi++]; }
     } else {
       path_list.push_back(arg);
     }
   }
 
-  if (path_list.empty() || opt_help) {
+  if (path_list.empty() || opt_help || (opt_compile && !output_path)) {
     cerr << R"(usage: grammar_file_path [source_file_path]
 
   options:
@@ -89,6 +103,10 @@ int main(int argc, const char **argv) {
     --trace: show concise trace messages
     --profile: show profile report
     --verbose: verbose output for trace and profile
+    --perf-report: report grammar patterns which slow down parsing
+    --emit-cpp name: write C++ code which builds the grammar with `load_<name>_grammar`
+    --compile: write the grammar in the compiled form for `load_compiled`
+    -o path: output file path for `--compile` and `--emit-cpp`
 )";
 
     return 1;
@@ -109,14 +127,60 @@ int main(int argc, const char **argv) {
     cerr << syntax_path << ":" << ln << ":" << col << ": " << msg << endl;
   });
 
-  if (!parser.load_grammar(syntax.data(), syntax.size())) { return -1; }
+  string_view magic = peg::compiled_grammar_magic;
+  auto compiled = syntax.size() >= magic.size() &&
+                  equal(magic.begin(), magic.end(), syntax.begin());
+  if (compiled ? !parser.load_compiled(syntax.data(), syntax.size())
+               : !parser.load_grammar(syntax.data(), syntax.size())) {
+    return -1;
+  }
+
+  if (opt_perf_report) {
+    parser.report_performance([&](size_t ln, size_t col, const string &msg,
+                                  const string & /*rule*/) {
+      cout << syntax_path << ":" << ln << ":" << col << ": " << msg << endl;
+    });
+  }
+
+  if (opt_emit_cpp) {
+    auto code = parser.generate_cpp(emit_cpp_name);
+    if (code.empty()) {
+      cerr << "can't generate C++ code from the grammar." << endl;
+      return -1;
+    }
+    if (!output_path) {
+      std::cout << code;
+      return 0;
+    }
+    ofstream ofs(output_path, ios::out | ios::binary);
+    if (!ofs.write(code.data(), static_cast<streamsize>(code.size()))) {
+      cerr << "can't write the C++ code." << endl;
+      return -1;
+    }
+    return 0;
+  }
+
+  if (opt_compile) {
+    auto data = parser.save_compiled();
+    if (data.empty()) {
+      cerr << "can't compile the grammar." << endl;
+      return -1;
+    }
+    ofstream ofs(output_path, ios::out | ios::binary);
+    if (!ofs.write(data.data(), static_cast<streamsize>(data.size()))) {
+      cerr << "can't write the compiled grammar." << endl;
+      return -1;
+    }
+    return 0;
+  }
 
   if (path_list.size() < 2 && !opt_source) { return 0; }
 
   // Check source
   std::string source_path = "[commandline]";
-  if (path_list.size() >= 2) {
-    if (!read_file(path_list[1], source)) {
+  auto opt_file = path_list.size() >= 2;
+  if (opt_file) {
+    if (!ifstream(path_list[1])) {
       cerr << "can't open the code file." << endl;
       return -1;
     }
@@ -136,19 +200,23 @@ int main(int argc, const char **argv) {
   parser.set_verbose_trace(opt_verbose);
 
   if (opt_ast) {
-    parser.enable_ast();
+    if (opt_optimize) {
+      parser.enable_optimized_ast(opt_mode);
+    } else {
+      parser.enable_ast();
+    }
 
     std::shared_ptr<peg::Ast> ast;
-    auto ret = parser.parse_n(source.data(), source.size(), ast);
+    auto ret = opt_file ? parser.parse_file(path_list[1], ast)
+                        : parser.parse_n(source.data(), source.size(), ast);
 
-    if (ast) {
-      if (opt_optimize) { ast = parser.optimize_ast(ast, opt_mode); }
-      std::cout << peg::ast_to_s(ast);
-    }
+    if (ast) { std::cout << peg::ast_to_s(ast); }
 
     if (!ret) { return -1; }
   } else {
-    if (!parser.parse_n(source.data(), source.size())) { return -1; }
+    auto ret = opt_file ? parser.parse_file(path_list[1])
+                        : parser.parse_n(source.data(), source.size());
+    if (!ret) { return -1; }
   }
 
   return 0;
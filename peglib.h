@@ -15,17 +15,32 @@
 #define CPPPEGLIB_HEURISTIC_ERROR_TOKEN_MAX_CHAR_COUNT 32
 #endif
 
+// Repetitions of character classes scan 16 bytes at a time with SSE2 unless
+// CPPPEGLIB_NO_SIMD is defined.
+#if !defined(CPPPEGLIB_NO_SIMD) &&                                             \
+    (defined(__SSE2__) || defined(_M_X64) ||                                   \
+     (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define CPPPEGLIB_USE_SSE2
+#endif
+
 #include <algorithm>
 #include <any>
+#include <array>
+#include <atomic>
+#include <bitset>
 #include <cassert>
 #include <cctype>
 #if __has_include(<charconv>)
 #include <charconv>
 #endif
+#include <chrono>
+#include <cstdint>
 #include <cstring>
+#include <fstream>
 #include <functional>
 #include <initializer_list>
 #include <iostream>
+#include <iterator>
 #include <limits>
 #include <map>
 #include <memory>
@@ -33,10 +48,33 @@
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#ifdef CPPPEGLIB_USE_SSE2
+#include <emmintrin.h>
+#endif
+
+// Input files are memory-mapped unless CPPPEGLIB_NO_MMAP is defined.
+#ifndef CPPPEGLIB_NO_MMAP
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#endif
+
 #if !defined(__cplusplus) || __cplusplus < 201703L
 #error "Requires complete C++17 support"
 #endif
@@ -380,50 +418,85 @@ public:
   Trie() = default;
   Trie(const Trie &) = default;
 
-  Trie(const std::vector<std::string> &items) {
+  // The items are compiled to a DFA. Each byte which appears in the items
+  // gets a column of the transition table, and the other bytes have no
+  // transition at all.
+  Trie(const std::vector<std::string> &items, bool ignore_case = false)
+      : ignore_case_(ignore_case) {
     for (const auto &item : items) {
-      for (size_t len = 1; len <= item.size(); len++) {
-        auto last = len == item.size();
-        std::string_view sv(item.data(), len);
-        auto it = dic_.find(sv);
-        if (it == dic_.end()) {
-          dic_.emplace(sv, Info{last, last});
-        } else if (last) {
-          it->second.match = true;
-        } else {
-          it->second.done = false;
+      for (auto ch : item) {
+        auto b = fold(static_cast<uint8_t>(ch));
+        if (!columns_[b]) { columns_[b] = static_cast<uint16_t>(width_++); }
+      }
+    }
+    if (ignore_case_) {
+      for (auto b = 'A'; b <= 'Z'; b++) {
+        columns_[static_cast<uint8_t>(b)] = columns_[fold(b)];
+      }
+    }
+
+    next_.assign(width_, 0);
+    accept_.push_back(0);
+
+    for (size_t id = 0; id < items.size(); id++) {
+      const auto &item = items[id];
+      if (item.empty()) { continue; }
+      uint32_t state = 0;
+      for (auto ch : item) {
+        auto idx = state * width_ + columns_[static_cast<uint8_t>(ch)];
+        if (!next_[idx]) {
+          next_[idx] = static_cast<uint32_t>(accept_.size());
+          next_.resize(next_.size() + width_, 0);
+          accept_.push_back(0);
         }
+        state = next_[idx];
       }
+      accept_[state] = static_cast<uint32_t>(id + 1);
+      items_.push_back(item);
     }
+
+    std::sort(items_.begin(), items_.end());
+    items_.erase(std::unique(items_.begin(), items_.end()), items_.end());
   }
 
   size_t match(const char *text, size_t text_len) const {
+    size_t id = 0;
+    return match(text, text_len, id);
+  }
+
+  // `id` is set to the index in the constructor's items of the longest
+  // match, or of its last occurrence if it appears more than once.
+  size_t match(const char *text, size_t text_len, size_t &id) const {
     size_t match_len = 0;
-    auto done = false;
-    size_t len = 1;
-    while (!done && len <= text_len) {
-      std::string_view sv(text, len);
-      auto it = dic_.find(sv);
-      if (it == dic_.end()) {
-        done = true;
-      } else {
-        if (it->second.match) { match_len = len; }
-        if (it->second.done) { done = true; }
+    uint32_t state = 0;
+    for (size_t i = 0; i < text_len; i++) {
+      auto col = columns_[static_cast<uint8_t>(text[i])];
+      if (!col) { break; }
+      state = next_[state * width_ + col];
+      if (!state) { break; }
+      if (accept_[state]) {
+        match_len = i + 1;
+        id = accept_[state] - 1;
       }
-      len += 1;
     }
     return match_len;
   }
 
+  const std::vector<std::string> &items() const { return items_; }
+
+  bool ignore_case() const { return ignore_case_; }
+
 private:
-  struct Info {
-    bool done;
-    bool match;
-  };
+  uint8_t fold(uint8_t b) const {
+    return ignore_case_ && 'A' <= b && b <= 'Z' ? b + ('a' - 'A') : b;
+  }
 
-  // TODO: Use unordered_map when heterogeneous lookup is supported in C++20
-  // std::unordered_map<std::string, Info> dic_;
-  std::map<std::string, Info, std::less<>> dic_;
+  bool ignore_case_ = false;
+  std::array<uint16_t, 256> columns_{}; // 0 means no transition
+  size_t width_ = 1;
+  std::vector<uint32_t> next_;          // 0 means no transition
+  std::vector<uint32_t> accept_;        // item index + 1, or 0
+  std::vector<std::string> items_;
 };
 
 /*-----------------------------------------------------------------------------
@@ -473,6 +546,232 @@ inline constexpr unsigned int operator"" _(const char *s, size_t l) {
 
 } // namespace udl
 
+/*
+ * Monotonic arena
+ */
+class AstArena {
+public:
+  AstArena() = default;
+  AstArena(const AstArena &) = delete;
+  AstArena &operator=(const AstArena &) = delete;
+
+  // Memory is released only when the arena is destroyed.
+  void *allocate(size_t size, size_t align) {
+    auto p = static_cast<void *>(cur_);
+    if (!std::align(align, size, p, left_)) {
+      auto block_size = (std::max)(size + align, next_block_size_);
+      blocks_.emplace_back(new char[block_size]);
+      p = blocks_.back().get();
+      left_ = block_size;
+      std::align(align, size, p, left_);
+      next_block_size_ = (std::min)(next_block_size_ * 2, max_block_size_);
+    }
+    cur_ = static_cast<char *>(p) + size;
+    left_ -= size;
+    return p;
+  }
+
+private:
+  static constexpr size_t max_block_size_ = 1024 * 1024;
+
+  std::vector<std::unique_ptr<char[]>> blocks_;
+  char *cur_ = nullptr;
+  size_t left_ = 0;
+  size_t next_block_size_ = 4096;
+};
+
+// Allocates from an arena, or from the heap without one. It doesn't keep the
+// arena alive, which the root of the AST does.
+template <typename T> struct AstArenaAllocator {
+  using value_type = T;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  AstArenaAllocator(AstArena *arena = nullptr) noexcept : arena_(arena) {}
+
+  template <typename U>
+  AstArenaAllocator(const AstArenaAllocator<U> &rhs) noexcept
+      : arena_(rhs.arena_) {}
+
+  T *allocate(size_t n) {
+    if (!arena_) { return std::allocator<T>().allocate(n); }
+    return static_cast<T *>(arena_->allocate(sizeof(T) * n, alignof(T)));
+  }
+
+  void deallocate(T *p, size_t n) {
+    if (!arena_) { std::allocator<T>().deallocate(p, n); }
+  }
+
+  template <typename U> bool operator==(const AstArenaAllocator<U> &rhs) const {
+    return arena_ == rhs.arena_;
+  }
+
+  template <typename U> bool operator!=(const AstArenaAllocator<U> &rhs) const {
+    return arena_ != rhs.arena_;
+  }
+
+  AstArena *arena_;
+};
+
+// Makes a value returned by a parse keep the arena of its nodes alive. Only
+// an AST uses the arena, which the overload for it below does.
+template <typename T>
+void keep_ast_arena(T & /*val*/, const std::shared_ptr<AstArena> & /*arena*/) {}
+
+/*
+ * Mapped file
+ */
+class MappedFile {
+public:
+  // The file is read into memory if it can't be mapped.
+  explicit MappedFile(const char *path) {
+#ifndef CPPPEGLIB_NO_MMAP
+#ifdef _WIN32
+    auto file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) { return; }
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+      auto mapping =
+          CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      if (mapping) {
+        // The view keeps the mapping alive after the handles are closed.
+        auto p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+        if (p) {
+          data_ = static_cast<const char *>(p);
+          size_ = static_cast<size_t>(size.QuadPart);
+          mapped_ = true;
+        }
+      }
+    }
+    CloseHandle(file);
+#else
+    auto fd = open(path, O_RDONLY);
+    if (fd == -1) { return; }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      auto p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                    MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        data_ = static_cast<const char *>(p);
+        size_ = static_cast<size_t>(st.st_size);
+        mapped_ = true;
+      }
+    }
+    close(fd);
+#endif
+    if (mapped_) { return; }
+#endif
+
+    std::ifstream ifs(path, std::ios::in | std::ios::binary);
+    if (ifs.fail()) { return; }
+    buffer_.assign(std::istreambuf_iterator<char>(ifs),
+                   std::istreambuf_iterator<char>());
+    data_ = buffer_.empty() ? "" : buffer_.data();
+    size_ = buffer_.size();
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile() {
+#ifndef CPPPEGLIB_NO_MMAP
+    if (mapped_) {
+#ifdef _WIN32
+      UnmapViewOfFile(data_);
+#else
+      munmap(const_cast<char *>(data_), size_);
+#endif
+    }
+#endif
+  }
+
+  bool is_open() const { return data_ != nullptr; }
+
+  const char *data() const { return data_; }
+
+  size_t size() const { return size_; }
+
+private:
+  std::vector<char> buffer_;
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+  bool mapped_ = false;
+};
+
+/*
+ * Line index
+ */
+// Lines and columns of the positions in a text. The line ends are found on
+// the first query or by `build`, so the text must stay alive until then.
+// `Context` builds the index it made before the parse returns, so the AST
+// nodes which keep it don't refer to the text. Columns count bytes, and the
+// lines and the columns on the first line are moved by the offsets.
+class LineIndex {
+public:
+  LineIndex(const char *path, const char *s, size_t n)
+      : path(path ? path : ""), s_(s), n_(n) {}
+
+  // An index without a text, which only knows the positions given to `put`
+  explicit LineIndex(const char *path)
+      : path(path ? path : ""), n_(std::numeric_limits<size_t>::max()) {}
+
+  LineIndex(const LineIndex &) = delete;
+  LineIndex &operator=(const LineIndex &) = delete;
+
+  void build() const {
+    std::call_once(init_, [this]() {
+      for (size_t pos = 0; s_ && pos < n_; pos++) {
+        if (s_[pos] == '\n') { ends_.push_back(pos); }
+      }
+      ends_.push_back(n_);
+      s_ = nullptr;
+    });
+  }
+
+  // Puts `pos` of an index without a text at `line` and `column`. False is
+  // returned if it is already somewhere else.
+  bool put(size_t pos, size_t line, size_t column) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto [it, inserted] = places_.emplace(pos, std::pair(line, column));
+    return inserted || it->second == std::pair(line, column);
+  }
+
+  std::pair<size_t, size_t> line_info(size_t pos) const {
+    if (n_ == std::numeric_limits<size_t>::max()) {
+      // The columns go on from the place before.
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = places_.upper_bound(pos);
+      if (it == places_.begin()) {
+        return std::pair<size_t, size_t>(1, pos + 1);
+      }
+      const auto &[place, line_col] = *std::prev(it);
+      return std::pair(line_col.first, line_col.second + pos - place);
+    }
+    build();
+    auto it = std::lower_bound(ends_.begin(), ends_.end(), pos);
+    auto id = static_cast<size_t>(std::distance(ends_.begin(), it));
+    if (!id) {
+      auto col = static_cast<std::ptrdiff_t>(pos) + column_offset;
+      return std::pair(line_offset + 1, static_cast<size_t>(col) + 1);
+    }
+    return std::pair(line_offset + id + 1, pos - ends_[id - 1]);
+  }
+
+  const std::string path;
+  size_t line_offset = 0;
+  std::ptrdiff_t column_offset = 0;
+
+private:
+  mutable const char *s_ = nullptr;
+  const size_t n_;
+  mutable std::once_flag init_;
+  mutable std::vector<size_t> ends_;
+  mutable std::mutex mutex_;
+  mutable std::map<size_t, std::pair<size_t, size_t>> places_;
+};
+
 /*
  * Semantic values
  */
@@ -497,6 +796,12 @@ struct SemanticValues : protected std::vector<std::any> {
   // Line number and column at which the matched string is
   std::pair<size_t, size_t> line_info() const;
 
+  // Index of the lines of the input, shared by the whole parse
+  std::shared_ptr<const LineIndex> line_index() const;
+
+  // Arena shared by the AST nodes made during the current parse
+  std::shared_ptr<AstArena> ast_arena() const;
+
   // Choice count
   size_t choice_count() const { return choice_count_; }
 
@@ -533,17 +838,14 @@ struct SemanticValues : protected std::vector<std::any> {
     return r;
   }
 
+  // Moves the values of `chvs` to the end. When a vector here is still
+  // empty, it takes over the buffer of `chvs` instead.
   void append(SemanticValues &chvs) {
     sv_ = chvs.sv_;
-    for (auto &v : chvs) {
-      emplace_back(std::move(v));
-    }
-    for (auto &tag : chvs.tags) {
-      tags.emplace_back(std::move(tag));
-    }
-    for (auto &tok : chvs.tokens) {
-      tokens.emplace_back(std::move(tok));
-    }
+    append_vector(static_cast<std::vector<std::any> &>(*this),
+                  static_cast<std::vector<std::any> &>(chvs));
+    append_vector(tags, chvs.tags);
+    append_vector(tokens, chvs.tokens);
   }
 
   using std::vector<std::any>::iterator;
@@ -570,12 +872,23 @@ struct SemanticValues : protected std::vector<std::any> {
   using std::vector<std::any>::emplace_back;
 
 private:
+  template <typename T>
+  static void append_vector(std::vector<T> &v, std::vector<T> &chv) {
+    if (v.empty()) {
+      v.swap(chv);
+    } else {
+      v.insert(v.end(), std::make_move_iterator(chv.begin()),
+               std::make_move_iterator(chv.end()));
+    }
+  }
+
   friend class Context;
   friend class Sequence;
   friend class PrioritizedChoice;
   friend class Repetition;
   friend class Holder;
   friend class PrecedenceClimbing;
+  friend class Program;
 
   Context *c_ = nullptr;
   std::string_view sv_;
@@ -722,6 +1035,84 @@ private:
   }
 };
 
+/*
+ * Packrat memo table
+ */
+class PackratTable {
+public:
+  struct Entry {
+    size_t key = 0; // 0 means an empty slot
+    size_t len = 0;
+    std::any val;
+  };
+
+  // 0 means no limit
+  void set_limit(size_t max_entries) { max_entries_ = max_entries; }
+
+  size_t size() const { return size_; }
+
+  const Entry *find(size_t key) const {
+    if (entries_.empty()) { return nullptr; }
+    key++;
+    auto mask = entries_.size() - 1;
+    auto i = slot_of(key);
+    while (entries_[i].key != key) {
+      if (entries_[i].key == 0) { return nullptr; }
+      i = (i + 1) & mask;
+    }
+    return &entries_[i];
+  }
+
+  // Returns false if the entry couldn't be stored due to the limit.
+  bool insert(size_t key, size_t len, const std::any &val) {
+    if (max_entries_ && size_ >= max_entries_) { return false; }
+    if ((size_ + 1) * 4 > entries_.size() * 3) { grow(); }
+    key++;
+    auto mask = entries_.size() - 1;
+    auto i = slot_of(key);
+    while (entries_[i].key != 0 && entries_[i].key != key) {
+      i = (i + 1) & mask;
+    }
+    auto &e = entries_[i];
+    if (e.key == 0) { size_++; }
+    e.key = key;
+    e.len = len;
+    e.val = val;
+    return true;
+  }
+
+  void clear() {
+    entries_.clear();
+    size_ = 0;
+  }
+
+private:
+  size_t slot_of(size_t key) const {
+    // Fibonacci hashing
+    auto h = static_cast<uint64_t>(key) * 11400714819323198485ull;
+    return static_cast<size_t>(h >> 32) & (entries_.size() - 1);
+  }
+
+  void grow() {
+    auto capacity = entries_.empty() ? size_t(64) : entries_.size() * 2;
+    std::vector<Entry> entries(capacity);
+    entries.swap(entries_);
+    auto mask = entries_.size() - 1;
+    for (auto &e : entries) {
+      if (e.key == 0) { continue; }
+      auto i = slot_of(e.key);
+      while (entries_[i].key != 0) {
+        i = (i + 1) & mask;
+      }
+      entries_[i] = std::move(e);
+    }
+  }
+
+  std::vector<Entry> entries_;
+  size_t size_ = 0;
+  size_t max_entries_ = 0;
+};
+
 /*
  * Context
  */
@@ -737,6 +1128,124 @@ using TracerLeave = std::function<void(
 
 using TracerStartOrEnd = std::function<void(std::any &trace_data)>;
 
+/*
+ * Profile
+ */
+
+// Per rule counters collected by `parser::enable_profile`. They are updated
+// atomically, so one profile can be shared by parses on several threads.
+// Define CPPPEGLIB_NO_PROFILE to compile the counting out.
+class Profile {
+public:
+  struct Rule {
+    std::string name;
+    size_t success = 0;
+    size_t fail = 0;
+    // Bytes matched by the rules called from failed calls of this rule
+    size_t backtracked_bytes = 0;
+    size_t packrat_hits = 0;
+    size_t packrat_misses = 0;
+    // Time spent in the rule, with and without the rules it called
+    uint64_t inclusive_ns = 0;
+    uint64_t exclusive_ns = 0;
+  };
+
+  // Rules by definition id
+  std::vector<Rule> rules() const {
+    std::vector<Rule> rules(names_.size());
+    for (size_t id = 0; id < names_.size(); id++) {
+      const auto &cnt = counters_[id];
+      auto &rule = rules[id];
+      rule.name = names_[id];
+      rule.success = load(cnt.success);
+      rule.fail = load(cnt.fail);
+      rule.backtracked_bytes = load(cnt.backtracked_bytes);
+      rule.packrat_hits = load(cnt.packrat_hits);
+      rule.packrat_misses = load(cnt.packrat_misses);
+      rule.inclusive_ns = cnt.inclusive_ns.load(std::memory_order_relaxed);
+      rule.exclusive_ns = cnt.exclusive_ns.load(std::memory_order_relaxed);
+    }
+    return rules;
+  }
+
+  std::string to_json() const {
+    std::string out = "[";
+    for (const auto &rule : rules()) {
+      if (out.size() > 1) { out += ","; }
+      out += "\n  {\"name\": \"";
+      for (auto ch : rule.name) {
+        if (ch == '"' || ch == '\\') { out += '\\'; }
+        out += ch;
+      }
+      out += "\", \"success\": " + std::to_string(rule.success) +
+             ", \"fail\": " + std::to_string(rule.fail) +
+             ", \"backtracked_bytes\": " +
+             std::to_string(rule.backtracked_bytes) +
+             ", \"packrat_hits\": " + std::to_string(rule.packrat_hits) +
+             ", \"packrat_misses\": " + std::to_string(rule.packrat_misses) +
+             ", \"inclusive_ns\": " + std::to_string(rule.inclusive_ns) +
+             ", \"exclusive_ns\": " + std::to_string(rule.exclusive_ns) + "}";
+    }
+    out += "\n]\n";
+    return out;
+  }
+
+  std::string to_csv() const {
+    std::string out = "name,success,fail,backtracked_bytes,packrat_hits,"
+                      "packrat_misses,inclusive_ns,exclusive_ns\n";
+    for (const auto &rule : rules()) {
+      out += rule.name + "," + std::to_string(rule.success) + "," +
+             std::to_string(rule.fail) + "," +
+             std::to_string(rule.backtracked_bytes) + "," +
+             std::to_string(rule.packrat_hits) + "," +
+             std::to_string(rule.packrat_misses) + "," +
+             std::to_string(rule.inclusive_ns) + "," +
+             std::to_string(rule.exclusive_ns) + "\n";
+    }
+    return out;
+  }
+
+  // Reset the counters. No parse may be running with the profile.
+  void clear() {
+    if (counters_) { counters_.reset(new Counters[names_.size()]); }
+  }
+
+private:
+  friend class Context;
+  friend class Definition;
+  friend class Holder;
+
+  struct Counters {
+    std::atomic<uint64_t> success{0};
+    std::atomic<uint64_t> fail{0};
+    std::atomic<uint64_t> backtracked_bytes{0};
+    std::atomic<uint64_t> packrat_hits{0};
+    std::atomic<uint64_t> packrat_misses{0};
+    std::atomic<uint64_t> inclusive_ns{0};
+    std::atomic<uint64_t> exclusive_ns{0};
+  };
+
+  // `names` returns the rule names by definition id.
+  template <typename F> void init(F names) {
+    std::call_once(init_, [&]() {
+      names_ = names();
+      counters_.reset(new Counters[names_.size()]);
+    });
+  }
+
+  void add(std::atomic<uint64_t> Counters::*counter, size_t id, uint64_t n) {
+    (counters_[id].*counter).fetch_add(n, std::memory_order_relaxed);
+  }
+
+  static size_t load(const std::atomic<uint64_t> &counter) {
+    return static_cast<size_t>(counter.load(std::memory_order_relaxed));
+  }
+
+  std::once_flag init_;
+  std::vector<std::string> names_;
+  std::unique_ptr<Counters[]> counters_;
+};
+
 class Context {
 public:
   const char *path;
@@ -750,7 +1259,8 @@ public:
   size_t value_stack_size = 0;
 
   std::vector<Definition *> rule_stack;
-  std::vector<std::vector<std::shared_ptr<Ope>>> args_stack;
+  // Arguments of the macro calls being parsed, which the calls keep alive
+  std::vector<const std::vector<std::shared_ptr<Ope>> *> args_stack;
 
   size_t in_token_boundary_count = 0;
 
@@ -759,48 +1269,113 @@ public:
 
   std::shared_ptr<Ope> wordOpe;
 
-  std::vector<std::map<std::string_view, std::string>> capture_scope_stack;
+  // Named captures as views of the input, each with the depth of the capture
+  // scope which owns it. A scope which fails drops its captures from the end.
+  struct CaptureValue {
+    std::string_view name;
+    std::string_view value;
+    size_t scope;
+  };
+  std::vector<CaptureValue> capture_values;
   size_t capture_scope_stack_size = 0;
 
   std::vector<bool> cut_stack;
 
+  // Entries of the lowered rules being parsed: the choices to backtrack to,
+  // with the position and the sizes of the values to go back to, and the
+  // marks of the tokens and the ignored values, which have no `pc`.
+  struct ProgramFrame {
+    size_t pc;
+    const char *s;
+    size_t values;
+    size_t tags;
+    size_t tokens;
+    size_t captures;
+    size_t in_token_boundary_count;
+  };
+  std::vector<ProgramFrame> program_stack;
+
   const size_t def_count;
   const bool enablePackratParsing;
   std::vector<bool> cache_registered;
   std::vector<bool> cache_success;
 
-  std::map<std::pair<size_t, size_t>, std::tuple<size_t, std::any>>
-      cache_values;
+  PackratTable cache_values;
+
+  // Memo entries for the last `packrat_window` positions, used instead of
+  // the full tables above when the window is set.
+  const size_t packrat_window;
+  std::vector<PackratTable::Entry> cache_window;
+
+  // Per definition lookup and hit counts of the memo tables, collected when
+  // `packrat_stats` is set.
+  struct PackratStat {
+    size_t lookups = 0;
+    size_t hits = 0;
+  };
+  std::vector<PackratStat> *packrat_stats = nullptr;
+
+  // Profile, and the time spent in the rules called from the current rule
+  // and the bytes matched by rules so far, which it's collected with
+  Profile *profile = nullptr;
+  uint64_t profile_child_ns = 0;
+  size_t profile_matched = 0;
+
+  std::shared_ptr<AstArena> ast_arena;
+
+  // Operator rule of the innermost precedence climbing, and the token which
+  // it matched last
+  const Definition *binop_rule = nullptr;
+  std::string_view binop_token;
 
   TracerEnter tracer_enter;
   TracerLeave tracer_leave;
   std::any trace_data;
   const bool verbose_trace;
+  const bool tracing;
 
   Log log;
 
   Context(const char *path, const char *s, size_t l, size_t def_count,
           std::shared_ptr<Ope> whitespaceOpe, std::shared_ptr<Ope> wordOpe,
-          bool enablePackratParsing, TracerEnter tracer_enter,
+          bool enablePackratParsing, size_t packrat_cache_limit,
+          size_t packrat_window, TracerEnter tracer_enter,
           TracerLeave tracer_leave, std::any trace_data, bool verbose_trace,
           Log log)
       : path(path), s(s), l(l), whitespaceOpe(whitespaceOpe), wordOpe(wordOpe),
         def_count(def_count), enablePackratParsing(enablePackratParsing),
-        cache_registered(enablePackratParsing ? def_count * (l + 1) : 0),
-        cache_success(enablePackratParsing ? def_count * (l + 1) : 0),
+        packrat_window(enablePackratParsing ? (std::min)(packrat_window, l + 1)
+                                            : 0),
         tracer_enter(tracer_enter), tracer_leave(tracer_leave),
-        trace_data(trace_data), verbose_trace(verbose_trace), log(log) {
+        trace_data(trace_data), verbose_trace(verbose_trace),
+        tracing(this->tracer_enter && this->tracer_leave), log(log) {
+
+    reuse_buffers();
+
+    if (enablePackratParsing && !this->packrat_window) {
+      cache_registered.assign(def_count * (l + 1), false);
+      cache_success.assign(def_count * (l + 1), false);
+    }
+    cache_window.assign(this->packrat_window * def_count, {});
 
-    push_args({});
+    cache_values.set_limit(packrat_cache_limit);
+    static const std::vector<std::shared_ptr<Ope>> no_args;
+    push_args(no_args);
     push_capture_scope();
   }
 
   ~Context() {
     pop_capture_scope();
 
+    // The values of the parse, e.g. AST nodes, may keep the line index after
+    // the text is gone.
+    if (line_index_) { line_index_->build(); }
+
     assert(!value_stack_size);
     assert(!capture_scope_stack_size);
     assert(cut_stack.empty());
+
+    keep_buffers();
   }
 
   Context(const Context &) = delete;
@@ -815,13 +1390,50 @@ public:
       return;
     }
 
-    auto col = a_s - s;
-    auto idx = def_count * static_cast<size_t>(col) + def_id;
+    auto col = static_cast<size_t>(a_s - s);
+
+    if (packrat_window) {
+      auto &entry = cache_window[(col % packrat_window) * def_count + def_id];
+#ifndef CPPPEGLIB_NO_PROFILE
+      if (profile) {
+        profile->add(entry.key == col + 1 ? &Profile::Counters::packrat_hits
+                                          : &Profile::Counters::packrat_misses,
+                     def_id, 1);
+      }
+#endif
+      if (entry.key == col + 1) {
+        len = entry.len;
+        if (success(len)) { val = entry.val; }
+        return;
+      }
+      fn(val);
+      entry.key = col + 1;
+      entry.len = len;
+      entry.val = success(len) ? val : std::any();
+      return;
+    }
+
+    auto idx = def_count * col + def_id;
+
+    if (packrat_stats) {
+      auto &stat = (*packrat_stats)[def_id];
+      stat.lookups++;
+      if (cache_registered[idx]) { stat.hits++; }
+    }
+
+#ifndef CPPPEGLIB_NO_PROFILE
+    if (profile) {
+      profile->add(cache_registered[idx] ? &Profile::Counters::packrat_hits
+                                         : &Profile::Counters::packrat_misses,
+                   def_id, 1);
+    }
+#endif
 
     if (cache_registered[idx]) {
       if (cache_success[idx]) {
-        auto key = std::pair(col, def_id);
-        std::tie(len, val) = cache_values[key];
+        auto entry = cache_values.find(idx);
+        len = entry->len;
+        val = entry->val;
         return;
       } else {
         len = static_cast<size_t>(-1);
@@ -829,12 +1441,13 @@ public:
       }
     } else {
       fn(val);
-      cache_registered[idx] = true;
-      cache_success[idx] = success(len);
       if (success(len)) {
-        auto key = std::pair(col, def_id);
-        cache_values[key] = std::pair(len, val);
+        // Leave the position unregistered when the table is full, so that
+        // it will be parsed again next time.
+        if (!cache_values.insert(idx, len, val)) { return; }
       }
+      cache_registered[idx] = true;
+      cache_success[idx] = success(len);
       return;
     }
   }
@@ -875,43 +1488,56 @@ public:
   void pop_semantic_values_scope() { value_stack_size--; }
 
   // Arguments
-  void push_args(std::vector<std::shared_ptr<Ope>> &&args) {
-    args_stack.emplace_back(args);
+  void push_args(const std::vector<std::shared_ptr<Ope>> &args) {
+    args_stack.push_back(&args);
   }
 
   void pop_args() { args_stack.pop_back(); }
 
   const std::vector<std::shared_ptr<Ope>> &top_args() const {
-    return args_stack[args_stack.size() - 1];
+    return *args_stack.back();
   }
 
   // Capture scope
-  void push_capture_scope() {
-    assert(capture_scope_stack_size <= capture_scope_stack.size());
-    if (capture_scope_stack_size == capture_scope_stack.size()) {
-      capture_scope_stack.emplace_back(
-          std::map<std::string_view, std::string>());
-    } else {
-      auto &cs = capture_scope_stack[capture_scope_stack_size];
-      if (!cs.empty()) { cs.clear(); }
+  void push_capture_scope() { capture_scope_stack_size++; }
+
+  void pop_capture_scope() {
+    while (!capture_values.empty() &&
+           capture_values.back().scope >= capture_scope_stack_size) {
+      capture_values.pop_back();
     }
-    capture_scope_stack_size++;
+    capture_scope_stack_size--;
   }
 
-  void pop_capture_scope() { capture_scope_stack_size--; }
-
+  // Hands the captures of the current scope over to the parent scope
   void shift_capture_values() {
     assert(capture_scope_stack_size >= 2);
-    auto curr = &capture_scope_stack[capture_scope_stack_size - 1];
-    auto prev = curr - 1;
-    for (const auto &[k, v] : *curr) {
-      (*prev)[k] = v;
+    for (auto it = capture_values.rbegin();
+         it != capture_values.rend() && it->scope == capture_scope_stack_size;
+         ++it) {
+      it->scope--;
+    }
+  }
+
+  void set_capture_value(std::string_view name, std::string_view value) {
+    capture_values.push_back({name, value, capture_scope_stack_size});
+  }
+
+  // The latest value captured with `name`, or null
+  const std::string_view *find_capture_value(std::string_view name) const {
+    for (auto it = capture_values.rbegin(); it != capture_values.rend();
+         ++it) {
+      if (it->name == name) { return &it->value; }
     }
+    return nullptr;
   }
 
   // Error
   void set_error_pos(const char *a_s, const char *literal = nullptr);
 
+  // Whether the word expression matches at `a_s`
+  bool match_word(const char *a_s, size_t n);
+
   // Trace
   void trace_enter(const Ope &ope, const char *a_s, size_t n,
                    const SemanticValues &vs, std::any &dt);
@@ -921,29 +1547,96 @@ public:
 
   // Line info
   std::pair<size_t, size_t> line_info(const char *cur) const {
-    std::call_once(source_line_index_init_, [this]() {
-      for (size_t pos = 0; pos < l; pos++) {
-        if (s[pos] == '\n') { source_line_index.push_back(pos); }
-      }
-      source_line_index.push_back(l);
-    });
-
-    auto pos = static_cast<size_t>(std::distance(s, cur));
+    return line_index()->line_info(static_cast<size_t>(std::distance(s, cur)));
+  }
 
-    auto it = std::lower_bound(
-        source_line_index.begin(), source_line_index.end(), pos,
-        [](size_t element, size_t value) { return element < value; });
+  // The index is made on the first use unless it is given beforehand.
+  const std::shared_ptr<LineIndex> &line_index() const {
+    if (!line_index_) { line_index_ = std::make_shared<LineIndex>(path, s, l); }
+    return line_index_;
+  }
 
-    auto id = static_cast<size_t>(std::distance(source_line_index.begin(), it));
-    auto off = pos - (id == 0 ? 0 : source_line_index[id - 1] + 1);
-    return std::pair(id + 1, off + 1);
+  void set_line_index(std::shared_ptr<LineIndex> line_index) {
+    line_index_ = line_index;
   }
 
   size_t next_trace_id = 0;
   std::vector<size_t> trace_ids;
   bool ignore_trace_state = false;
-  mutable std::once_flag source_line_index_init_;
-  mutable std::vector<size_t> source_line_index;
+
+private:
+  mutable std::shared_ptr<LineIndex> line_index_;
+
+  // Buffers of finished parses, kept by each thread so that the next parse
+  // doesn't allocate them again
+  struct Buffers {
+    std::vector<std::shared_ptr<SemanticValues>> value_stack;
+    std::vector<CaptureValue> capture_values;
+    std::vector<const std::vector<std::shared_ptr<Ope>> *> args_stack;
+    std::vector<bool> cache_registered;
+    std::vector<bool> cache_success;
+    std::vector<PackratTable::Entry> cache_window;
+    std::vector<ProgramFrame> program_stack;
+  };
+
+  static constexpr size_t max_kept_buffers_ = 4;
+  static constexpr size_t max_kept_cache_size_ = 1024 * 1024;
+
+  static std::vector<std::unique_ptr<Buffers>> &buffer_pool() {
+    thread_local std::vector<std::unique_ptr<Buffers>> pool;
+    return pool;
+  }
+
+  void reuse_buffers() {
+    auto &pool = buffer_pool();
+    if (pool.empty()) { return; }
+    auto b = std::move(pool.back());
+    pool.pop_back();
+
+    value_stack.swap(b->value_stack);
+    for (auto &vs : value_stack) {
+      vs->c_ = this;
+    }
+    capture_values.swap(b->capture_values);
+    args_stack.swap(b->args_stack);
+    cache_registered.swap(b->cache_registered);
+    cache_success.swap(b->cache_success);
+    cache_window.swap(b->cache_window);
+    program_stack.swap(b->program_stack);
+  }
+
+  void keep_buffers() {
+    auto &pool = buffer_pool();
+    if (pool.size() >= max_kept_buffers_) { return; }
+
+    // Values from this parse must not outlive it.
+    for (auto &vs : value_stack) {
+      vs->clear();
+      vs->tags.clear();
+      vs->tokens.clear();
+    }
+    capture_values.clear();
+    args_stack.clear();
+    cache_window.clear();
+    program_stack.clear();
+
+    auto b = std::make_unique<Buffers>();
+    b->value_stack.swap(value_stack);
+    b->capture_values.swap(capture_values);
+    b->args_stack.swap(args_stack);
+    b->program_stack.swap(program_stack);
+    if (cache_registered.size() <= max_kept_cache_size_) {
+      b->cache_registered.swap(cache_registered);
+      b->cache_success.swap(cache_success);
+    }
+    if (cache_window.capacity() <= max_kept_cache_size_ / 64) {
+      b->cache_window.swap(cache_window);
+    }
+    pool.push_back(std::move(b));
+  }
+
+  // Context for the word checks, reused during the parse
+  std::unique_ptr<Context> word_context_;
 };
 
 /*
@@ -988,6 +1681,9 @@ public:
   std::vector<std::shared_ptr<Ope>> opes_;
 };
 
+// Whether one of `rules` has an enter or a leave handler now
+inline bool has_handlers(const std::vector<const Definition *> &rules);
+
 class PrioritizedChoice : public Ope {
 public:
   template <typename... Args>
@@ -1004,8 +1700,20 @@ public:
 
     if (!for_label_) { c.cut_stack.push_back(false); }
 
+    // Alternatives which can't start with the next byte are skipped. They
+    // would still leave error positions behind, so the log disables this,
+    // and an enter or leave handler set after the first sets on a rule they
+    // look through does for the alternative.
+    auto dispatch = !first_sets_.empty() && n > 0 && !c.log && !c.tracing;
+
     size_t id = 0;
     for (const auto &ope : opes_) {
+      if (dispatch && !first_sets_[id][static_cast<uint8_t>(*s)] &&
+          !has_handlers(first_rules_[id])) {
+        id++;
+        continue;
+      }
+
       if (!c.cut_stack.empty()) { c.cut_stack.back() = false; }
 
       auto &chvs = c.push();
@@ -1039,17 +1747,28 @@ public:
 
   size_t size() const { return opes_.size(); }
 
+  void init_first_sets();
+
   std::vector<std::shared_ptr<Ope>> opes_;
   bool for_label_ = false;
+
+private:
+  std::once_flag first_sets_init_;
+  std::vector<std::bitset<256>> first_sets_;
+  // The rules which the first sets looked through, by the alternatives
+  std::vector<std::vector<const Definition *>> first_rules_;
 };
 
+class CharacterClass;
+
 class Repetition : public Ope {
 public:
-  Repetition(const std::shared_ptr<Ope> &ope, size_t min, size_t max)
-      : ope_(ope), min_(min), max_(max) {}
+  Repetition(const std::shared_ptr<Ope> &ope, size_t min, size_t max);
 
   size_t parse_core(const char *s, size_t n, SemanticValues &vs, Context &c,
                     std::any &dt) const override {
+    if ((class_ || any_char_) && !c.tracing) { return parse_chars(s, n, c); }
+
     size_t count = 0;
     size_t i = 0;
     while (count < min_) {
@@ -1109,6 +1828,17 @@ public:
   std::shared_ptr<Ope> ope_;
   size_t min_;
   size_t max_;
+
+private:
+  // Repetition of a character class or `.` doesn't produce semantic values
+  // nor captures, so it is matched directly without the value stack.
+  size_t parse_chars(const char *s, size_t n, Context &c) const;
+
+  const CharacterClass *class_ = nullptr;
+  bool any_char_ = false;
+
+  friend class Program;
+  friend struct LowerOpe;
 };
 
 class AndPredicate : public Ope {
@@ -1158,7 +1888,8 @@ public:
 
 class Dictionary : public Ope, public std::enable_shared_from_this<Dictionary> {
 public:
-  Dictionary(const std::vector<std::string> &v) : trie_(v) {}
+  Dictionary(const std::vector<std::string> &v, bool ignore_case = false)
+      : trie_(v, ignore_case) {}
 
   size_t parse_core(const char *s, size_t n, SemanticValues &vs, Context &c,
                     std::any &dt) const override;
@@ -1182,6 +1913,8 @@ public:
 
   void accept(Visitor &v) override;
 
+  void init_is_word(const std::shared_ptr<Ope> &wordOpe) const;
+
   std::string lit_;
   bool ignore_case_;
   mutable std::once_flag init_is_word_;
@@ -1208,12 +1941,14 @@ public:
       }
     }
     assert(!ranges_.empty());
+    init();
   }
 
   CharacterClass(const std::vector<std::pair<char32_t, char32_t>> &ranges,
                  bool negated, bool ignore_case)
       : ranges_(ranges), negated_(negated), ignore_case_(ignore_case) {
     assert(!ranges_.empty());
+    init();
   }
 
   size_t parse_core(const char *s, size_t n, SemanticValues & /*vs*/,
@@ -1224,43 +1959,118 @@ public:
     }
 
     char32_t cp = 0;
-    auto len = decode_codepoint(s, n, cp);
-
-    for (const auto &range : ranges_) {
-      if (in_range(range, cp)) {
-        if (negated_) {
-          c.set_error_pos(s);
-          return static_cast<size_t>(-1);
-        } else {
-          return len;
-        }
-      }
-    }
-
-    if (negated_) {
-      return len;
+    size_t len = 1;
+    if (static_cast<uint8_t>(s[0]) < 0x80) {
+      cp = static_cast<uint8_t>(s[0]);
     } else {
-      c.set_error_pos(s);
-      return static_cast<size_t>(-1);
+      len = decode_codepoint(s, n, cp);
     }
+
+    if (match(cp)) { return len; }
+
+    c.set_error_pos(s);
+    return static_cast<size_t>(-1);
   }
 
   void accept(Visitor &v) override;
 
-private:
-  bool in_range(const std::pair<char32_t, char32_t> &range, char32_t cp) const {
-    if (ignore_case_) {
-      auto cpl = std::tolower(cp);
-      return std::tolower(range.first) <= cpl &&
-             cpl <= std::tolower(range.second);
-    } else {
-      return range.first <= cp && cp <= range.second;
+  // Whether `cp` is accepted by the class, including the negation.
+  bool match(char32_t cp) const {
+    if (cp < 256) { return bitmap_[cp]; }
+    return in_ranges(cp) != negated_;
+  }
+
+  // Length of the leading run of ASCII characters accepted by the class.
+  size_t match_ascii_run(const char *s, size_t n) const {
+    size_t i = 0;
+#ifdef CPPPEGLIB_USE_SSE2
+    if (!ascii_ranges_.empty()) {
+      // Bytes above 0x7f are negative as signed chars, so they never fall
+      // into the ranges and stop the scan.
+      while (i + 16 <= n) {
+        auto x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+        auto m = _mm_setzero_si128();
+        for (const auto &[lo, hi] : ascii_ranges_) {
+          auto in =
+              _mm_cmpgt_epi8(x, _mm_set1_epi8(static_cast<char>(lo - 1)));
+          if (hi < 0x7f) {
+            auto below = _mm_set1_epi8(static_cast<char>(hi + 1));
+            in = _mm_and_si128(in, _mm_cmplt_epi8(x, below));
+          }
+          m = _mm_or_si128(m, in);
+        }
+        if (_mm_movemask_epi8(m) != 0xffff) { break; }
+        i += 16;
+      }
+    }
+#endif
+    while (i < n) {
+      auto b = static_cast<uint8_t>(s[i]);
+      if (b >= 0x80 || !bitmap_[b]) { break; }
+      i++;
     }
+    return i;
   }
 
   std::vector<std::pair<char32_t, char32_t>> ranges_;
   bool negated_;
   bool ignore_case_;
+
+private:
+  static char32_t to_lower(char32_t cp) {
+    return 'A' <= cp && cp <= 'Z' ? cp + ('a' - 'A') : cp;
+  }
+
+  void init() {
+    // Case folding is applied to both ends of each range, and to the input
+    // codepoint, so that `[A-z]i` means `[a-z]`.
+    for (const auto &[cp1, cp2] : ranges_) {
+      auto first = ignore_case_ ? to_lower(cp1) : cp1;
+      auto second = ignore_case_ ? to_lower(cp2) : cp2;
+      if (first <= second) { sorted_ranges_.emplace_back(first, second); }
+    }
+
+    std::sort(sorted_ranges_.begin(), sorted_ranges_.end());
+    std::vector<std::pair<char32_t, char32_t>> merged;
+    for (const auto &range : sorted_ranges_) {
+      if (!merged.empty() && range.first <= merged.back().second + 1) {
+        merged.back().second = (std::max)(merged.back().second, range.second);
+      } else {
+        merged.push_back(range);
+      }
+    }
+    sorted_ranges_.swap(merged);
+
+    for (char32_t cp = 0; cp < 256; cp++) {
+      bitmap_[cp] = in_ranges(cp) != negated_;
+    }
+
+    // The vector scan compares against each ASCII run, so it's used only
+    // when there are a few of them.
+    for (int cp = 0; cp < 0x80; cp++) {
+      if (!bitmap_[cp]) { continue; }
+      if (!ascii_ranges_.empty() && ascii_ranges_.back().second + 1 == cp) {
+        ascii_ranges_.back().second = cp;
+      } else {
+        ascii_ranges_.emplace_back(cp, cp);
+      }
+    }
+    if (ascii_ranges_.size() > 4) { ascii_ranges_.clear(); }
+  }
+
+  bool in_ranges(char32_t cp) const {
+    if (ignore_case_) { cp = to_lower(cp); }
+    auto it = std::upper_bound(
+        sorted_ranges_.begin(), sorted_ranges_.end(), cp,
+        [](char32_t a, const std::pair<char32_t, char32_t> &range) {
+          return a < range.first;
+        });
+    return it != sorted_ranges_.begin() && cp <= std::prev(it)->second;
+  }
+
+  std::bitset<256> bitmap_;
+  std::vector<std::pair<char32_t, char32_t>> sorted_ranges_;
+  std::vector<std::pair<int, int>> ascii_ranges_;
 };
 
 class Character : public Ope, public std::enable_shared_from_this<Character> {
@@ -1297,6 +2107,43 @@ public:
   void accept(Visitor &v) override;
 };
 
+inline Repetition::Repetition(const std::shared_ptr<Ope> &ope, size_t min,
+                              size_t max)
+    : ope_(ope), min_(min), max_(max),
+      class_(dynamic_cast<const CharacterClass *>(ope.get())),
+      any_char_(dynamic_cast<const AnyCharacter *>(ope.get()) != nullptr) {}
+
+inline size_t Repetition::parse_chars(const char *s, size_t n,
+                                      Context &c) const {
+  size_t count = 0;
+  size_t i = 0;
+  while (count < max_ && i < n) {
+    size_t len = 0;
+    if (class_) {
+      auto run =
+          class_->match_ascii_run(s + i, (std::min)(n - i, max_ - count));
+      if (run) {
+        i += run;
+        count += run;
+        continue;
+      }
+      char32_t cp = 0;
+      len = decode_codepoint(s + i, n - i, cp);
+      if (!class_->match(cp)) { break; }
+    } else {
+      len = codepoint_length(s + i, n - i);
+    }
+    if (len == 0) { break; }
+    i += len;
+    count++;
+  }
+
+  // The error position is where the last attempt of the operand failed.
+  if (count < max_) { c.set_error_pos(s + i); }
+  if (count < min_) { return static_cast<size_t>(-1); }
+  return i;
+}
+
 class CaptureScope : public Ope {
 public:
   CaptureScope(const std::shared_ptr<Ope> &ope) : ope_(ope) {}
@@ -1317,8 +2164,9 @@ class Capture : public Ope {
 public:
   using MatchAction = std::function<void(const char *s, size_t n, Context &c)>;
 
-  Capture(const std::shared_ptr<Ope> &ope, MatchAction ma)
-      : ope_(ope), match_action_(ma) {}
+  Capture(const std::shared_ptr<Ope> &ope, MatchAction ma,
+          std::string_view name = std::string_view())
+      : ope_(ope), match_action_(ma), name_(name) {}
 
   size_t parse_core(const char *s, size_t n, SemanticValues &vs, Context &c,
                     std::any &dt) const override {
@@ -1331,6 +2179,7 @@ public:
 
   std::shared_ptr<Ope> ope_;
   MatchAction match_action_;
+  std::string_view name_;
 };
 
 class TokenBoundary : public Ope {
@@ -1394,6 +2243,8 @@ public:
   std::weak_ptr<Ope> weak_;
 };
 
+class Program;
+
 class Holder : public Ope {
 public:
   Holder(Definition *outer) : outer_(outer) {}
@@ -1407,11 +2258,19 @@ public:
 
   const std::string &name() const;
   const std::string &trace_name() const;
+  bool is_choice() const;
 
   std::shared_ptr<Ope> ope_;
   Definition *outer_;
   mutable std::once_flag trace_name_init_;
   mutable std::string trace_name_;
+  mutable std::once_flag is_choice_init_;
+  mutable bool is_choice_ = false;
+
+  // Set by `Program::lower` when the rule is parsed by the instructions at
+  // `program_entry_`
+  std::shared_ptr<const Program> program_;
+  size_t program_entry_ = 0;
 
   friend class Definition;
 };
@@ -1441,6 +2300,12 @@ public:
 
   Definition *rule_;
   size_t iarg_;
+
+  // Set by `InstantiateMacros` when the arguments don't refer to parameters
+  // of the enclosing macro. The call then parses `instance_`, the macro body
+  // made for the arguments, if there is one, or else uses `args_` as they are.
+  Holder *instance_ = nullptr;
+  bool args_resolved_ = false;
 };
 
 class Whitespace : public Ope {
@@ -1481,7 +2346,13 @@ public:
   PrecedenceClimbing(const std::shared_ptr<Ope> &atom,
                      const std::shared_ptr<Ope> &binop, const BinOpeInfo &info,
                      const Definition &rule)
-      : atom_(atom), binop_(binop), info_(info), rule_(rule) {}
+      : atom_(atom), binop_(binop), rule_(rule) {
+    for (const auto &[tok, level_assoc] : info) {
+      tokens_.emplace_back(tok);
+      levels_.push_back(level_assoc);
+    }
+    operators_ = Trie(tokens_);
+  }
 
   size_t parse_core(const char *s, size_t n, SemanticValues &vs, Context &c,
                     std::any &dt) const override {
@@ -1492,14 +2363,21 @@ public:
 
   std::shared_ptr<Ope> atom_;
   std::shared_ptr<Ope> binop_;
-  BinOpeInfo info_;
   const Definition &rule_;
 
+  // Operator tokens, and their levels and associativities by the token ids.
+  // The keys of the info given may refer to the grammar text, but these are
+  // owned.
+  std::vector<std::string> tokens_;
+  std::vector<std::pair<size_t, char>> levels_;
+
 private:
   size_t parse_expression(const char *s, size_t n, SemanticValues &vs,
                           Context &c, std::any &dt, size_t min_prec) const;
 
-  Definition &get_reference_for_binop(Context &c) const;
+  Trie operators_;
+
+  const Definition *get_reference_for_binop(Context &c) const;
 };
 
 class Recovery : public Ope {
@@ -1567,8 +2445,9 @@ inline std::shared_ptr<Ope> npd(const std::shared_ptr<Ope> &ope) {
   return std::make_shared<NotPredicate>(ope);
 }
 
-inline std::shared_ptr<Ope> dic(const std::vector<std::string> &v) {
-  return std::make_shared<Dictionary>(v);
+inline std::shared_ptr<Ope> dic(const std::vector<std::string> &v,
+                                bool ignore_case = false) {
+  return std::make_shared<Dictionary>(v, ignore_case);
 }
 
 inline std::shared_ptr<Ope> lit(std::string &&s) {
@@ -1614,6 +2493,16 @@ inline std::shared_ptr<Ope> cap(const std::shared_ptr<Ope> &ope,
   return std::make_shared<Capture>(ope, ma);
 }
 
+inline std::shared_ptr<Ope> cap(const std::shared_ptr<Ope> &ope,
+                                std::string_view name) {
+  return std::make_shared<Capture>(
+      ope,
+      [name](const char *a_s, size_t a_n, Context &c) {
+        c.set_capture_value(name, std::string_view(a_s, a_n));
+      },
+      name);
+}
+
 inline std::shared_ptr<Ope> tok(const std::shared_ptr<Ope> &ope) {
   return std::make_shared<TokenBoundary>(ope);
 }
@@ -1728,6 +2617,7 @@ struct AssignIDToDefinition : public Ope::Visitor {
     }
   }
   void visit(PrioritizedChoice &ope) override {
+    choices.push_back(&ope);
     for (auto op : ope.opes_) {
       op->accept(*this);
     }
@@ -1746,7 +2636,12 @@ struct AssignIDToDefinition : public Ope::Visitor {
   void visit(PrecedenceClimbing &ope) override;
   void visit(Recovery &ope) override { ope.ope_->accept(*this); }
 
+  void visit(LiteralString &ope) override { literals.push_back(&ope); }
+
   std::unordered_map<void *, size_t> ids;
+  std::vector<PrioritizedChoice *> choices;
+  std::vector<LiteralString *> literals;
+  std::unordered_set<const Holder *> instances;
 };
 
 struct IsLiteralToken : public Ope::Visitor {
@@ -1823,6 +2718,110 @@ private:
   const char *token_ = nullptr;
 };
 
+// Computes the bytes an expression can start with. An expression which can
+// match the empty string, or which runs handlers or predicates before
+// consuming input, can start anywhere.
+struct FirstSet : public Ope::Visitor {
+  void visit(Sequence &ope) override {
+    std::bitset<256> chars;
+    auto nullable = true;
+    for (auto op : ope.opes_) {
+      first(*op);
+      chars |= chars_;
+      if (!nullable_) {
+        nullable = false;
+        break;
+      }
+    }
+    chars_ = chars;
+    nullable_ = nullable;
+  }
+  void visit(PrioritizedChoice &ope) override {
+    std::bitset<256> chars;
+    auto nullable = false;
+    for (auto op : ope.opes_) {
+      first(*op);
+      chars |= chars_;
+      if (nullable_) { nullable = true; }
+    }
+    chars_ = chars;
+    nullable_ = nullable;
+  }
+  void visit(Repetition &ope) override {
+    first(*ope.ope_);
+    if (ope.min_ == 0) { nullable_ = true; }
+  }
+  void visit(Dictionary &ope) override {
+    chars_.reset();
+    nullable_ = false;
+    for (const auto &item : ope.trie_.items()) {
+      add(item[0], ope.trie_.ignore_case());
+    }
+  }
+  void visit(LiteralString &ope) override {
+    chars_.reset();
+    nullable_ = ope.lit_.empty();
+    if (!nullable_) { add(ope.lit_[0], ope.ignore_case_); }
+  }
+  void visit(CharacterClass &ope) override;
+  void visit(Character &ope) override {
+    chars_.reset();
+    nullable_ = false;
+    add(ope.ch_, false);
+  }
+  void visit(AnyCharacter &) override {
+    chars_.set();
+    nullable_ = false;
+  }
+  void visit(CaptureScope &ope) override { first(*ope.ope_); }
+  void visit(Capture &ope) override { first(*ope.ope_); }
+  void visit(TokenBoundary &ope) override { first(*ope.ope_); }
+  void visit(Ignore &ope) override { first(*ope.ope_); }
+  void visit(WeakHolder &ope) override { first(*ope.weak_.lock()); }
+  void visit(Holder &ope) override;
+  void visit(Reference &ope) override;
+  void visit(PrecedenceClimbing &ope) override { first(*ope.atom_); }
+
+  // The rules looked through are added to `rules`, if it's given. These
+  // have no enter or leave handlers, and one set later makes the first set
+  // wrong, as the rule is no longer skipped silently.
+  static std::bitset<256>
+  chars(Ope &ope, std::vector<const Definition *> *rules = nullptr) {
+    FirstSet vis;
+    vis.rules_ = rules;
+    vis.first(ope);
+    if (vis.nullable_) { vis.chars_.set(); }
+    return vis.chars_;
+  }
+
+private:
+  // Operators without a visit above can start anywhere.
+  void first(Ope &ope) {
+    chars_.set();
+    nullable_ = true;
+    ope.accept(*this);
+  }
+
+  void add(char ch, bool ignore_case) {
+    auto b = static_cast<uint8_t>(ch);
+    if (ignore_case && b >= 0x80) {
+      for (size_t i = 0x80; i < 256; i++) {
+        chars_.set(i);
+      }
+    } else if (ignore_case) {
+      chars_.set(static_cast<uint8_t>(std::tolower(b)));
+      chars_.set(static_cast<uint8_t>(std::toupper(b)));
+    } else {
+      chars_.set(b);
+    }
+  }
+
+  std::bitset<256> chars_;
+  bool nullable_ = true;
+  std::unordered_set<Holder *> holders_;
+  std::vector<const Definition *> *rules_ = nullptr;
+};
+
 struct DetectLeftRecursion : public Ope::Visitor {
   DetectLeftRecursion(const std::string &name) : name_(name) {}
 
@@ -1992,6 +2991,62 @@ private:
   std::unordered_map<std::string, bool> &has_error_cache_;
 };
 
+// Finds grammar patterns which make parsing slower than it needs to be in
+// one rule. `whitespace` is the %whitespace operator, if any.
+struct PerformanceLint : public Ope::Visitor {
+  PerformanceLint(const std::shared_ptr<Ope> &whitespace) {
+    if (whitespace) { has_ws_class_ = skip_class(*whitespace, ws_class_); }
+  }
+
+  void visit(Sequence &ope) override;
+  void visit(PrioritizedChoice &ope) override;
+  void visit(Repetition &ope) override;
+  void visit(AndPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(NotPredicate &ope) override { ope.ope_->accept(*this); }
+  void visit(CaptureScope &ope) override { ope.ope_->accept(*this); }
+  void visit(Capture &ope) override { ope.ope_->accept(*this); }
+  void visit(TokenBoundary &ope) override {
+    in_token_++;
+    ope.ope_->accept(*this);
+    in_token_--;
+  }
+  void visit(Ignore &ope) override { ope.ope_->accept(*this); }
+  void visit(WeakHolder &ope) override { ope.weak_.lock()->accept(*this); }
+  void visit(Holder &ope) override;
+  void visit(Reference &ope) override {
+    for (auto arg : ope.args_) {
+      arg->accept(*this);
+    }
+  }
+  void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
+  void visit(PrecedenceClimbing &ope) override {
+    ope.atom_->accept(*this);
+    ope.binop_->accept(*this);
+  }
+  void visit(Recovery &ope) override { ope.ope_->accept(*this); }
+
+  std::vector<std::string> messages;
+
+private:
+  // The name of the rule which `ope` starts with, if any
+  static const std::string *leading_rule(Ope &ope);
+
+  // Whether `ope` is a repetition of a character class, which is set to
+  // the bytes below 0x80 that it matches
+  static bool skip_class(Ope &ope, std::bitset<128> &chars);
+
+  static std::string char_to_s(size_t b) {
+    if (0x20 <= b && b < 0x7f) { return std::string("'") + char(b) + "'"; }
+    char buff[8];
+    snprintf(buff, sizeof(buff), "\\x%02zx", b);
+    return buff;
+  }
+
+  bool has_ws_class_ = false;
+  std::bitset<128> ws_class_;
+  size_t in_token_ = 0;
+};
+
 struct ReferenceChecker : public Ope::Visitor {
   ReferenceChecker(const Grammar &grammar,
                    const std::vector<std::string> &params)
@@ -2018,7 +3073,10 @@ struct ReferenceChecker : public Ope::Visitor {
   void visit(Holder &ope) override { ope.ope_->accept(*this); }
   void visit(Reference &ope) override;
   void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
-  void visit(PrecedenceClimbing &ope) override { ope.atom_->accept(*this); }
+  void visit(PrecedenceClimbing &ope) override {
+    ope.atom_->accept(*this);
+    ope.binop_->accept(*this);
+  }
   void visit(Recovery &ope) override { ope.ope_->accept(*this); }
 
   std::unordered_map<std::string, const char *> error_s;
@@ -2055,7 +3113,10 @@ struct LinkReferences : public Ope::Visitor {
   void visit(Holder &ope) override { ope.ope_->accept(*this); }
   void visit(Reference &ope) override;
   void visit(Whitespace &ope) override { ope.ope_->accept(*this); }
-  void visit(PrecedenceClimbing &ope) override { ope.atom_->accept(*this); }
+  void visit(PrecedenceClimbing &ope) override {
+    ope.atom_->accept(*this);
+    ope.binop_->accept(*this);
+  }
   void visit(Recovery &ope) override { ope.ope_->accept(*this); }
 
 private:
@@ -2111,7 +3172,8 @@ struct FindReference : public Ope::Visitor {
   }
   void visit(Capture &ope) override {
     ope.ope_->accept(*this);
-    found_ope = cap(found_ope, ope.match_action_);
+    found_ope = std::make_shared<Capture>(found_ope, ope.match_action_,
+                                          ope.name_);
   }
   void visit(TokenBoundary &ope) override {
     ope.ope_->accept(*this);
@@ -2145,6 +3207,172 @@ private:
   const std::vector<std::string> &params_;
 };
 
+/*
+ * Lowering
+ */
+
+// Instructions which the rules of a grammar can be lowered to. They parse a
+// rule without the virtual calls and the value scopes of its operators, and
+// call the other rules through their holders. The rules with macros,
+// precedence climbing, recovery, cuts, captures or user operators aren't
+// lowered. The instructions are used only when the parse has no logger nor
+// tracer, since they don't keep the error positions.
+class Program {
+public:
+  enum class Op : uint8_t {
+    Char,          // The byte `arg`
+    Any,           // Any character
+    Class,         // The character class `ope`
+    Span,          // The repetition `ope` of a class or any character
+    Literal,       // The literal `ope`, with the word check
+    Dictionary,    // The dictionary `ope`, with the word check
+    Space,         // The whitespace, out of token boundaries
+    Call,          // The rule of the holder `ope`
+    Test,          // Jump to `arg` unless the next byte is in set `arg2`
+    Choice,        // Push a choice to backtrack to `arg`
+    Commit,        // Pop the choice and jump to `arg`
+    PartialCommit, // Move the choice to the position and jump to `arg`
+    BackCommit,    // Pop the choice, go back to it and jump to `arg`
+    FailTwice,     // Pop the choice and fail
+    Fail,          // Fail
+    Jump,          // Jump to `arg`
+    TokenBegin,    // Push a token boundary
+    TokenEnd,      // Pop the token boundary and add the token
+    IgnoreBegin,   // Push a mark of the values
+    IgnoreEnd,     // Pop the mark and drop the values after it
+    Choose,        // Set the choice `arg` of `arg2` choices of the rule
+    Return,        // Succeed
+  };
+
+  struct Instruction {
+    Op op;
+    size_t arg = 0;
+    size_t arg2 = 0;
+    const Ope *ope = nullptr;
+  };
+
+  // Lower the rules of `grammar`, parsed from `start`, to a program which
+  // they share, and return the number of the lowered rules.
+  static size_t lower(Grammar &grammar, const std::string &start);
+
+  size_t parse(size_t pc, const char *s, size_t n, SemanticValues &vs,
+               Context &c, std::any &dt) const;
+
+  std::vector<Instruction> code;
+  std::vector<std::bitset<256>> first_sets;
+  // The rules which the first sets looked through
+  std::vector<std::vector<const Definition *>> first_rules;
+
+private:
+  size_t parse_whitespace(const char *s, size_t n, Context &c,
+                          std::any &dt) const;
+
+  // The whitespace operator, if its instructions are at `whitespace_entry_`
+  const Ope *whitespace_ = nullptr;
+  size_t whitespace_entry_ = 0;
+};
+
+struct LowerOpe : public Ope::Visitor {
+  using Op = Program::Op;
+
+  LowerOpe(Program &program) : program_(program) {}
+
+  // Emit the instructions of `ope`, and return false if it has an operator
+  // which can't be lowered.
+  bool lower(Ope &ope) {
+    lowered_ = true;
+    lower(ope, true);
+    emit(Op::Return);
+    return lowered_;
+  }
+
+  void visit(Sequence &ope) override {
+    for (auto op : ope.opes_) {
+      lower(*op, false);
+    }
+  }
+  void visit(PrioritizedChoice &ope) override;
+  void visit(Repetition &ope) override;
+  void visit(AndPredicate &ope) override {
+    auto choice = emit(Op::Choice);
+    lower(*ope.ope_, false);
+    auto back_commit = emit(Op::BackCommit);
+    program_.code[choice].arg = here();
+    emit(Op::Fail);
+    program_.code[back_commit].arg = here();
+  }
+  void visit(NotPredicate &ope) override {
+    auto choice = emit(Op::Choice);
+    lower(*ope.ope_, false);
+    emit(Op::FailTwice);
+    program_.code[choice].arg = here();
+  }
+  void visit(Dictionary &ope) override {
+    emit(Op::Dictionary, 0, 0, &ope);
+    skip_whitespace();
+  }
+  void visit(LiteralString &ope) override {
+    emit(Op::Literal, 0, 0, &ope);
+    skip_whitespace();
+  }
+  void visit(CharacterClass &ope) override { emit(Op::Class, 0, 0, &ope); }
+  void visit(Character &ope) override {
+    emit(Op::Char, static_cast<uint8_t>(ope.ch_));
+  }
+  void visit(AnyCharacter &) override { emit(Op::Any); }
+  void visit(CaptureScope &) override { lowered_ = false; }
+  void visit(Capture &) override { lowered_ = false; }
+  void visit(TokenBoundary &ope) override {
+    emit(Op::TokenBegin);
+    in_token_boundary_++;
+    lower(*ope.ope_, choice_);
+    in_token_boundary_--;
+    emit(Op::TokenEnd);
+    skip_whitespace();
+  }
+  void visit(Ignore &ope) override {
+    emit(Op::IgnoreBegin);
+    lower(*ope.ope_, false);
+    emit(Op::IgnoreEnd);
+  }
+  void visit(User &) override { lowered_ = false; }
+  void visit(WeakHolder &ope) override { ope.weak_.lock()->accept(*this); }
+  void visit(Holder &ope) override;
+  void visit(Reference &ope) override;
+  void visit(Whitespace &) override { lowered_ = false; }
+  void visit(BackReference &) override { lowered_ = false; }
+  void visit(PrecedenceClimbing &) override { lowered_ = false; }
+  void visit(Recovery &) override { lowered_ = false; }
+  void visit(Cut &) override { lowered_ = false; }
+
+private:
+  // `choice` tells whether a choice of `ope` is the choice of the rule.
+  void lower(Ope &ope, bool choice) {
+    auto save_choice = choice_;
+    choice_ = choice;
+    ope.accept(*this);
+    choice_ = save_choice;
+  }
+
+  size_t emit(Op op, size_t arg = 0, size_t arg2 = 0,
+              const Ope *ope = nullptr) {
+    program_.code.push_back({op, arg, arg2, ope});
+    return program_.code.size() - 1;
+  }
+
+  size_t here() const { return program_.code.size(); }
+
+  // Inside a token boundary of the rule, the whitespace isn't skipped.
+  void skip_whitespace() {
+    if (!in_token_boundary_) { emit(Op::Space); }
+  }
+
+  Program &program_;
+  bool lowered_ = true;
+  bool choice_ = false;
+  size_t in_token_boundary_ = 0;
+};
+
 /*
  * Keywords
  */
@@ -2162,6 +3390,7 @@ public:
     bool recovered;
     size_t len;
     ErrorInfo error_info;
+    std::shared_ptr<AstArena> ast_arena;
   };
 
   Definition() : holder_(std::make_shared<Holder>(this)) {}
@@ -2218,6 +3447,7 @@ public:
     auto r = parse_core(s, n, vs, dt, path, log);
     if (r.ret && !vs.empty() && vs.front().has_value()) {
       val = std::any_cast<T>(vs[0]);
+      keep_ast_arena(val, r.ast_arena);
     }
     return r;
   }
@@ -2237,6 +3467,7 @@ public:
     auto r = parse_core(s, n, vs, dt, path, log);
     if (r.ret && !vs.empty() && vs.front().has_value()) {
       val = std::any_cast<T>(vs[0]);
+      keep_ast_arena(val, r.ast_arena);
     }
     return r;
   }
@@ -2249,6 +3480,39 @@ public:
     return parse_and_get_value(s, n, dt, val, path, log);
   }
 
+  // Initialize the state which is otherwise computed by the first parse, so
+  // that parsing doesn't modify the grammar any more.
+  void freeze() const {
+    initialize_definition_ids();
+    for (const auto &[p, _] : definition_ids_) {
+      auto rule = static_cast<const Definition *>(p);
+      rule->is_token();
+      rule->error_literal();
+      rule->holder_->is_choice();
+      rule->holder_->trace_name();
+    }
+  }
+
+  // Parse a sample input with packrat parsing, memoizing every rule, and
+  // set `no_packrat` of the rules whose memoized results are reused less
+  // than `min_hit_ratio` of the time, and clear it of the others. The rules
+  // which the sample never tries keep their setting, since there is nothing
+  // to tell for them.
+  Result train_packrat(const char *s, size_t n, std::any &dt,
+                       double min_hit_ratio, const char *path = nullptr) {
+    SemanticValues vs;
+    std::vector<Context::PackratStat> stats;
+    auto r = parse_core(s, n, vs, dt, path, nullptr, &stats);
+    for (const auto &[p, id] : definition_ids_) {
+      const auto &stat = stats[id];
+      if (stat.lookups) {
+        static_cast<Definition *>(p)->no_packrat =
+            static_cast<double>(stat.hits) < min_hit_ratio * stat.lookups;
+      }
+    }
+    return r;
+  }
+
 #if defined(__cpp_lib_char8_t)
   Result parse(const char8_t *s, size_t n, const char *path = nullptr,
                Log log = nullptr) const {
@@ -2326,6 +3590,17 @@ public:
     return is_token_;
   }
 
+  // The literal which the rule is expected to match, if any
+  const char *error_literal() const {
+    std::call_once(error_literal_init_, [this]() {
+      if (auto token = FindLiteralToken::token(*get_core_operator());
+          token && token[0] != '\0') {
+        error_literal_ = token;
+      }
+    });
+    return error_literal_;
+  }
+
   std::string name;
   const char *s_ = nullptr;
   std::pair<size_t, size_t> line_ = {1, 1};
@@ -2335,6 +3610,10 @@ public:
       predicate;
 
   size_t id = 0;
+  // `str2tag(name)`, which is set when the rule is first parsed
+  unsigned int tag = 0;
+  // Dense id in [0, grammar size), which `parser` assigns in name order
+  size_t rule_id = std::numeric_limits<size_t>::max();
   Action action;
   std::function<void(const Context &c, const char *s, size_t n, std::any &dt)>
       enter;
@@ -2345,8 +3624,14 @@ public:
   std::shared_ptr<Ope> whitespaceOpe;
   std::shared_ptr<Ope> wordOpe;
   bool enablePackratParsing = false;
+  size_t packrat_cache_limit = 0;
+  size_t packrat_window = 0;
+  bool no_packrat = false;
   bool is_macro = false;
   std::vector<std::string> params;
+  // Bodies of a macro made for the arguments of its calls, by the pointers of
+  // the arguments
+  std::map<std::vector<const Ope *>, std::shared_ptr<Holder>> instances;
   bool disable_action = false;
 
   TracerEnter tracer_enter;
@@ -2359,10 +3644,13 @@ public:
   bool no_ast_opt = false;
 
   bool eoi_check = true;
+  bool two_pass_error_reporting = false;
+  std::shared_ptr<Profile> profile;
 
 private:
   friend class Reference;
   friend class ParserGenerator;
+  friend class Program;
 
   Definition &operator=(const Definition &rhs);
   Definition &operator=(Definition &&rhs);
@@ -2374,13 +3662,34 @@ private:
       if (whitespaceOpe) { whitespaceOpe->accept(vis); }
       if (wordOpe) { wordOpe->accept(vis); }
       definition_ids_.swap(vis.ids);
+      for (auto choice : vis.choices) {
+        choice->init_first_sets();
+      }
+      if (wordOpe) {
+        for (auto lit : vis.literals) {
+          lit->init_is_word(wordOpe);
+        }
+      }
     });
   }
 
   Result parse_core(const char *s, size_t n, SemanticValues &vs, std::any &dt,
-                    const char *path, Log log) const {
+                    const char *path, Log log,
+                    std::vector<Context::PackratStat> *packrat_stats =
+                        nullptr) const {
     initialize_definition_ids();
 
+    // The first pass doesn't keep track of errors. Only when it fails, the
+    // input is parsed again to collect the error information.
+    if (log && two_pass_error_reporting && !packrat_stats && !tracer_enter) {
+      SemanticValues first_vs;
+      auto r = parse_core(s, n, first_vs, dt, path, nullptr);
+      if (r.ret && !r.recovered) {
+        vs = std::move(first_vs);
+        return r;
+      }
+    }
+
     std::shared_ptr<Ope> ope = holder_;
 
     std::any trace_data;
@@ -2389,9 +3698,32 @@ private:
       if (tracer_end) { tracer_end(trace_data); }
     });
 
+    // Counting needs the full memo tables.
+    auto packrat_full = packrat_stats != nullptr;
+
     Context c(path, s, n, definition_ids_.size(), whitespaceOpe, wordOpe,
-              enablePackratParsing, tracer_enter, tracer_leave, trace_data,
-              verbose_trace, log);
+              enablePackratParsing || packrat_full,
+              packrat_full ? 0 : packrat_cache_limit,
+              packrat_full ? 0 : packrat_window, tracer_enter, tracer_leave,
+              trace_data, verbose_trace, log);
+
+    if (packrat_full) {
+      packrat_stats->assign(definition_ids_.size(), {});
+      c.packrat_stats = packrat_stats;
+    }
+
+#ifndef CPPPEGLIB_NO_PROFILE
+    if (profile) {
+      profile->init([&]() {
+        std::vector<std::string> names(definition_ids_.size());
+        for (const auto &[p, id] : definition_ids_) {
+          names[id] = static_cast<Definition *>(p)->name;
+        }
+        return names;
+      });
+      c.profile = profile.get();
+    }
+#endif
 
     size_t i = 0;
 
@@ -2402,7 +3734,9 @@ private:
           scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
 
       auto len = whitespaceOpe->parse(s, n, vs, c, dt);
-      if (fail(len)) { return Result{false, c.recovered, i, c.error_info}; }
+      if (fail(len)) {
+        return Result{false, c.recovered, i, c.error_info, nullptr};
+      }
 
       i = len;
     }
@@ -2421,12 +3755,14 @@ private:
         }
       }
     }
-    return Result{ret, c.recovered, i, c.error_info};
+    return Result{ret, c.recovered, i, c.error_info, c.ast_arena};
   }
 
   std::shared_ptr<Holder> holder_;
   mutable std::once_flag is_token_init_;
   mutable bool is_token_ = false;
+  mutable std::once_flag error_literal_init_;
+  mutable const char *error_literal_ = nullptr;
   mutable std::once_flag assign_id_to_definition_init_;
   mutable std::once_flag definition_ids_init_;
   mutable std::unordered_map<void *, size_t> definition_ids_;
@@ -2437,14 +3773,14 @@ private:
  */
 
 inline size_t parse_literal(const char *s, size_t n, SemanticValues &vs,
-                            Context &c, std::any &dt, const std::string &lit,
+                            Context &c, std::any &dt, std::string_view lit,
                             std::once_flag &init_is_word, bool &is_word,
-                            bool ignore_case) {
+                            bool ignore_case, const char *error_literal) {
   size_t i = 0;
   for (; i < lit.size(); i++) {
     if (i >= n || (ignore_case ? (std::tolower(s[i]) != std::tolower(lit[i]))
                                : (s[i] != lit[i]))) {
-      c.set_error_pos(s, lit.data());
+      c.set_error_pos(s, error_literal);
       return static_cast<size_t>(-1);
     }
   }
@@ -2457,29 +3793,12 @@ inline size_t parse_literal(const char *s, size_t n, SemanticValues &vs,
         scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
 
     std::call_once(init_is_word, [&]() {
-      SemanticValues dummy_vs;
-      Context dummy_c(nullptr, c.s, c.l, 0, nullptr, nullptr, false, nullptr,
-                      nullptr, nullptr, false, nullptr);
-      std::any dummy_dt;
-
-      auto len =
-          c.wordOpe->parse(lit.data(), lit.size(), dummy_vs, dummy_c, dummy_dt);
-      is_word = success(len);
+      is_word = c.match_word(lit.data(), lit.size());
     });
 
-    if (is_word) {
-      SemanticValues dummy_vs;
-      Context dummy_c(nullptr, c.s, c.l, 0, nullptr, nullptr, false, nullptr,
-                      nullptr, nullptr, false, nullptr);
-      std::any dummy_dt;
-
-      NotPredicate ope(c.wordOpe);
-      auto len = ope.parse(s + i, n - i, dummy_vs, dummy_c, dummy_dt);
-      if (fail(len)) {
-        c.set_error_pos(s, lit.data());
-        return len;
-      }
-      i += len;
+    if (is_word && c.match_word(s + i, n - i)) {
+      c.set_error_pos(s, error_literal);
+      return static_cast<size_t>(-1);
     }
   }
 
@@ -2503,6 +3822,17 @@ inline std::pair<size_t, size_t> SemanticValues::line_info() const {
   return c_->line_info(sv_.data());
 }
 
+inline std::shared_ptr<const LineIndex> SemanticValues::line_index() const {
+  assert(c_);
+  return c_->line_index();
+}
+
+inline std::shared_ptr<AstArena> SemanticValues::ast_arena() const {
+  assert(c_);
+  if (!c_->ast_arena) { c_->ast_arena = std::make_shared<AstArena>(); }
+  return c_->ast_arena;
+}
+
 inline void ErrorInfo::output_log(const Log &log, const char *s, size_t n) {
   if (message_pos) {
     if (message_pos > last_output_pos) {
@@ -2584,12 +3914,7 @@ inline void Context::set_error_pos(const char *a_s, const char *literal) {
       if (literal) {
         error_literal = literal;
       } else if (!rule_stack.empty()) {
-        auto rule = rule_stack.back();
-        auto ope = rule->get_core_operator();
-        if (auto token = FindLiteralToken::token(*ope);
-            token && token[0] != '\0') {
-          error_literal = token;
-        }
+        error_literal = rule_stack.back()->error_literal();
       }
 
       for (auto r : rule_stack) {
@@ -2604,6 +3929,30 @@ inline void Context::set_error_pos(const char *a_s, const char *literal) {
   }
 }
 
+inline bool Context::match_word(const char *a_s, size_t n) {
+  if (!word_context_) {
+    word_context_ =
+        std::make_unique<Context>(nullptr, s, l, 0, nullptr, nullptr, false, 0,
+                                  0, nullptr, nullptr, nullptr, false, nullptr);
+  }
+
+  auto &wc = *word_context_;
+  auto &vs = wc.push();
+  auto se = scope_exit([&]() { wc.pop(); });
+
+  std::any dt;
+  return success(wordOpe->parse(a_s, n, vs, wc, dt));
+}
+
+inline void LiteralString::init_is_word(
+    const std::shared_ptr<Ope> &wordOpe) const {
+  std::call_once(init_is_word_, [&]() {
+    Context c(nullptr, lit_.data(), lit_.size(), 0, nullptr, wordOpe, false, 0,
+              0, nullptr, nullptr, nullptr, false, nullptr);
+    is_word_ = c.match_word(lit_.data(), lit_.size());
+  });
+}
+
 inline void Context::trace_enter(const Ope &ope, const char *a_s, size_t n,
                                  const SemanticValues &vs, std::any &dt) {
   trace_ids.push_back(next_trace_id++);
@@ -2618,7 +3967,7 @@ inline void Context::trace_leave(const Ope &ope, const char *a_s, size_t n,
 }
 
 inline bool Context::is_traceable(const Ope &ope) const {
-  if (tracer_enter && tracer_leave) {
+  if (tracing) {
     if (ignore_trace_state) { return false; }
     return !dynamic_cast<const peg::Reference *>(&ope);
   }
@@ -2627,7 +3976,7 @@ inline bool Context::is_traceable(const Ope &ope) const {
 
 inline size_t Ope::parse(const char *s, size_t n, SemanticValues &vs,
                          Context &c, std::any &dt) const {
-  if (c.is_traceable(*this)) {
+  if (c.tracing && c.is_traceable(*this)) {
     c.trace_enter(*this, s, n, vs, dt);
     auto len = parse_core(s, n, vs, c, dt);
     c.trace_leave(*this, s, n, vs, dt, len);
@@ -2652,19 +4001,9 @@ inline size_t Dictionary::parse_core(const char *s, size_t n,
     auto se =
         scope_exit([&]() { c.ignore_trace_state = save_ignore_trace_state; });
 
-    {
-      SemanticValues dummy_vs;
-      Context dummy_c(nullptr, c.s, c.l, 0, nullptr, nullptr, false, nullptr,
-                      nullptr, nullptr, false, nullptr);
-      std::any dummy_dt;
-
-      NotPredicate ope(c.wordOpe);
-      auto len = ope.parse(s + i, n - i, dummy_vs, dummy_c, dummy_dt);
-      if (fail(len)) {
-        c.set_error_pos(s);
-        return len;
-      }
-      i += len;
+    if (c.match_word(s + i, n - i)) {
+      c.set_error_pos(s);
+      return static_cast<size_t>(-1);
     }
   }
 
@@ -2687,7 +4026,7 @@ inline size_t LiteralString::parse_core(const char *s, size_t n,
                                         SemanticValues &vs, Context &c,
                                         std::any &dt) const {
   return parse_literal(s, n, vs, c, dt, lit_, init_is_word_, is_word_,
-                       ignore_case_);
+                       ignore_case_, lit_.c_str());
 }
 
 inline size_t TokenBoundary::parse_core(const char *s, size_t n,
@@ -2733,10 +4072,22 @@ inline size_t Holder::parse_core(const char *s, size_t n, SemanticValues &vs,
     return len;
   }
 
+#ifndef CPPPEGLIB_NO_PROFILE
+  std::chrono::steady_clock::time_point profile_start;
+  uint64_t save_child_ns = 0;
+  size_t save_matched = 0;
+  if (c.profile) {
+    profile_start = std::chrono::steady_clock::now();
+    save_child_ns = c.profile_child_ns;
+    save_matched = c.profile_matched;
+    c.profile_child_ns = 0;
+  }
+#endif
+
   size_t len;
   std::any val;
 
-  c.packrat(s, outer_->id, len, val, [&](std::any &a_val) {
+  auto parse_rule = [&](std::any &a_val) {
     if (outer_->enter) { outer_->enter(c, s, n, dt); }
     auto &chvs = c.push_semantic_values_scope();
     auto se = scope_exit([&]() {
@@ -2745,7 +4096,11 @@ inline size_t Holder::parse_core(const char *s, size_t n, SemanticValues &vs,
     });
 
     c.rule_stack.push_back(outer_);
-    len = ope_->parse(s, n, chvs, c, dt);
+    if (program_ && !c.log && !c.tracing) {
+      len = program_->parse(program_entry_, s, n, chvs, c, dt);
+    } else {
+      len = ope_->parse(s, n, chvs, c, dt);
+    }
     c.rule_stack.pop_back();
 
     // Invoke action
@@ -2753,14 +4108,7 @@ inline size_t Holder::parse_core(const char *s, size_t n, SemanticValues &vs,
       chvs.sv_ = std::string_view(s, len);
       chvs.name_ = outer_->name;
 
-      auto ope_ptr = ope_.get();
-      {
-        auto tok_ptr = dynamic_cast<const peg::TokenBoundary *>(ope_ptr);
-        if (tok_ptr) {
-          ope_ptr = tok_ptr->ope_.get();
-        }
-      }
-      if (!dynamic_cast<const peg::PrioritizedChoice *>(ope_ptr)) {
+      if (!is_choice()) {
         chvs.choice_count_ = 0;
         chvs.choice_ = 0;
       }
@@ -2776,6 +4124,7 @@ inline size_t Holder::parse_core(const char *s, size_t n, SemanticValues &vs,
       }
 
       if (success(len)) {
+        if (c.binop_rule == outer_) { c.binop_token = chvs.token(); }
         if (!c.recovered) { a_val = reduce(chvs, dt); }
       } else {
         if (c.log && !msg.empty() && c.error_info.message_pos < s) {
@@ -2792,19 +4141,83 @@ inline size_t Holder::parse_core(const char *s, size_t n, SemanticValues &vs,
         c.error_info.label = outer_->name;
       }
     }
-  });
+  };
+
+  // A memoized result wouldn't leave the operator token for precedence
+  // climbing. The training counts the rules which aren't memoized, too.
+  if ((outer_->no_packrat && !c.packrat_stats) || c.binop_rule == outer_) {
+    parse_rule(val);
+  } else {
+    c.packrat(s, outer_->id, len, val, parse_rule);
+  }
 
   if (success(len)) {
     if (!outer_->ignoreSemanticValue) {
       vs.emplace_back(std::move(val));
-      vs.tags.emplace_back(str2tag(outer_->name));
+      vs.tags.emplace_back(outer_->tag);
+    }
+  }
+
+#ifndef CPPPEGLIB_NO_PROFILE
+  if (c.profile) {
+    auto ns = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - profile_start)
+            .count());
+    auto id = outer_->id;
+    c.profile->add(&Profile::Counters::inclusive_ns, id, ns);
+    c.profile->add(&Profile::Counters::exclusive_ns, id,
+                   ns - (std::min)(ns, c.profile_child_ns));
+    c.profile_child_ns = save_child_ns + ns;
+    if (success(len)) {
+      c.profile->add(&Profile::Counters::success, id, 1);
+      c.profile_matched += len;
+    } else {
+      c.profile->add(&Profile::Counters::fail, id, 1);
+      c.profile->add(&Profile::Counters::backtracked_bytes, id,
+                     c.profile_matched - save_matched);
     }
   }
+#endif
 
   return len;
 }
 
-inline std::any Holder::reduce(SemanticValues &vs, std::any &dt) const {
+inline bool has_handlers(const std::vector<const Definition *> &rules) {
+  return std::any_of(rules.begin(), rules.end(), [](const Definition *rule) {
+    return rule->enter || rule->leave;
+  });
+}
+
+inline void PrioritizedChoice::init_first_sets() {
+  std::call_once(first_sets_init_, [this]() {
+    std::vector<std::bitset<256>> first_sets;
+    std::vector<std::vector<const Definition *>> first_rules(opes_.size());
+    auto dispatch = false;
+    for (size_t id = 0; id < opes_.size(); id++) {
+      first_sets.push_back(FirstSet::chars(*opes_[id], &first_rules[id]));
+      if (!first_sets.back().all()) { dispatch = true; }
+    }
+    if (dispatch) {
+      first_sets_.swap(first_sets);
+      first_rules_.swap(first_rules);
+    }
+  });
+}
+
+inline bool Holder::is_choice() const {
+  std::call_once(is_choice_init_, [this]() {
+    auto ope_ptr = ope_.get();
+    {
+      auto tok_ptr = dynamic_cast<const peg::TokenBoundary *>(ope_ptr);
+      if (tok_ptr) { ope_ptr = tok_ptr->ope_.get(); }
+    }
+    is_choice_ = dynamic_cast<const peg::PrioritizedChoice *>(ope_ptr);
+  });
+  return is_choice_;
+}
+
+inline std::any Holder::reduce(SemanticValues &vs, std::any &dt) const {
   if (outer_->action && !outer_->disable_action) {
     return outer_->action(vs, dt);
   } else if (vs.empty()) {
@@ -2835,6 +4248,14 @@ inline size_t Reference::parse_core(const char *s, size_t n, SemanticValues &vs,
     // Reference rule
     if (rule_->is_macro) {
       // Macro
+      if (instance_) { return instance_->parse(s, n, vs, c, dt); }
+
+      if (args_resolved_) {
+        c.push_args(args_);
+        auto se = scope_exit([&]() { c.pop_args(); });
+        return rule_->holder_->parse(s, n, vs, c, dt);
+      }
+
       FindReference vis(c.top_args(), c.rule_stack.back()->params);
 
       // Collect arguments
@@ -2844,16 +4265,14 @@ inline size_t Reference::parse_core(const char *s, size_t n, SemanticValues &vs,
         args.emplace_back(std::move(vis.found_ope));
       }
 
-      c.push_args(std::move(args));
+      c.push_args(args);
       auto se = scope_exit([&]() { c.pop_args(); });
-      auto ope = get_core_operator();
-      return ope->parse(s, n, vs, c, dt);
+      return rule_->holder_->parse(s, n, vs, c, dt);
     } else {
       // Definition
-      c.push_args(std::vector<std::shared_ptr<Ope>>());
-      auto se = scope_exit([&]() { c.pop_args(); });
-      auto ope = get_core_operator();
-      return ope->parse(s, n, vs, c, dt);
+      // NOTE: A definition body has no parameters, so the arguments of the
+      // enclosing macro are left on the stack.
+      return rule_->holder_->parse(s, n, vs, c, dt);
     }
   } else {
     // Reference parameter in macro
@@ -2869,16 +4288,12 @@ inline std::shared_ptr<Ope> Reference::get_core_operator() const {
 inline size_t BackReference::parse_core(const char *s, size_t n,
                                         SemanticValues &vs, Context &c,
                                         std::any &dt) const {
-  auto size = static_cast<int>(c.capture_scope_stack_size);
-  for (auto i = size - 1; i >= 0; i--) {
-    auto index = static_cast<size_t>(i);
-    const auto &cs = c.capture_scope_stack[index];
-    if (cs.find(name_) != cs.end()) {
-      const auto &lit = cs.at(name_);
-      std::once_flag init_is_word;
-      auto is_word = false;
-      return parse_literal(s, n, vs, c, dt, lit, init_is_word, is_word, false);
-    }
+  if (auto lit = c.find_capture_value(name_)) {
+    // The value is a view of the input, so it can't be an error literal.
+    std::once_flag init_is_word;
+    auto is_word = false;
+    return parse_literal(s, n, vs, c, dt, *lit, init_is_word, is_word, false,
+                         nullptr);
   }
 
   c.error_info.message_pos = s;
@@ -2886,17 +4301,17 @@ inline size_t BackReference::parse_core(const char *s, size_t n,
   return static_cast<size_t>(-1);
 }
 
-inline Definition &
+inline const Definition *
 PrecedenceClimbing::get_reference_for_binop(Context &c) const {
   if (rule_.is_macro) {
     // Reference parameter in macro
     const auto &args = c.top_args();
     auto iarg = dynamic_cast<Reference &>(*binop_).iarg_;
     auto arg = args[iarg];
-    return *dynamic_cast<Reference &>(*arg).rule_;
+    return dynamic_cast<Reference &>(*arg).rule_;
   }
 
-  return *dynamic_cast<Reference &>(*binop_).rule_;
+  return dynamic_cast<Reference &>(*binop_).rule_;
 }
 
 inline size_t PrecedenceClimbing::parse_expression(const char *s, size_t n,
@@ -2906,59 +4321,59 @@ inline size_t PrecedenceClimbing::parse_expression(const char *s, size_t n,
   auto len = atom_->parse(s, n, vs, c, dt);
   if (fail(len)) { return len; }
 
-  std::string tok;
-  auto &rule = get_reference_for_binop(c);
-  auto action = std::move(rule.action);
-
-  rule.action = [&](SemanticValues &vs2, std::any &dt2) {
-    tok = vs2.token();
-    if (action) {
-      return action(vs2, dt2);
-    } else if (!vs2.empty()) {
-      return vs2[0];
-    }
-    return std::any();
-  };
-  auto action_se = scope_exit([&]() { rule.action = std::move(action); });
+  // The operator rule leaves its token in the context.
+  auto save_binop_rule = c.binop_rule;
+  c.binop_rule = get_reference_for_binop(c);
+  auto binop_se = scope_exit([&]() { c.binop_rule = save_binop_rule; });
 
   auto i = len;
   while (i < n) {
-    std::vector<std::any> save_values(vs.begin(), vs.end());
-    auto save_tokens = vs.tokens;
+    auto save_size = vs.size();
 
-    auto chvs = c.push_semantic_values_scope();
-    auto chlen = binop_->parse(s + i, n - i, chvs, c, dt);
-    c.pop_semantic_values_scope();
+    // The scopes are popped once their values are moved out, so that the
+    // pooled values are reused without a copy.
+    size_t next_min_prec;
+    {
+      c.binop_token = std::string_view();
+      auto &chvs = c.push_semantic_values_scope();
+      auto se = scope_exit([&]() { c.pop_semantic_values_scope(); });
+      auto chlen = binop_->parse(s + i, n - i, chvs, c, dt);
 
-    if (fail(chlen)) { break; }
+      if (fail(chlen)) { break; }
 
-    auto it = info_.find(tok);
-    if (it == info_.end()) { break; }
+      const auto &tok = c.binop_token;
+      size_t id = 0;
+      if (tok.empty() ||
+          operators_.match(tok.data(), tok.size(), id) != tok.size()) {
+        break;
+      }
 
-    auto level = std::get<0>(it->second);
-    auto assoc = std::get<1>(it->second);
+      auto level = levels_[id].first;
+      auto assoc = levels_[id].second;
 
-    if (level < min_prec) { break; }
+      if (level < min_prec) { break; }
 
-    vs.emplace_back(std::move(chvs[0]));
-    i += chlen;
+      vs.emplace_back(std::move(chvs[0]));
+      i += chlen;
 
-    auto next_min_prec = level;
-    if (assoc == 'L') { next_min_prec = level + 1; }
+      next_min_prec = level;
+      if (assoc == 'L') { next_min_prec = level + 1; }
+    }
 
-    chvs = c.push_semantic_values_scope();
-    chlen = parse_expression(s + i, n - i, chvs, c, dt, next_min_prec);
-    c.pop_semantic_values_scope();
+    {
+      auto &chvs = c.push_semantic_values_scope();
+      auto se = scope_exit([&]() { c.pop_semantic_values_scope(); });
+      auto chlen = parse_expression(s + i, n - i, chvs, c, dt, next_min_prec);
 
-    if (fail(chlen)) {
-      vs.assign(save_values.begin(), save_values.end());
-      vs.tokens = save_tokens;
-      i = chlen;
-      break;
-    }
+      if (fail(chlen)) {
+        vs.resize(save_size);
+        i = chlen;
+        break;
+      }
 
-    vs.emplace_back(std::move(chvs[0]));
-    i += chlen;
+      vs.emplace_back(std::move(chvs[0]));
+      i += chlen;
+    }
 
     std::any val;
     if (rule_.action) {
@@ -3053,6 +4468,7 @@ inline void AssignIDToDefinition::visit(Holder &ope) {
   auto id = ids.size();
   ids[p] = id;
   ope.outer_->id = id;
+  ope.outer_->tag = str2tag(ope.outer_->name);
   ope.ope_->accept(*this);
 }
 
@@ -3063,6 +4479,9 @@ inline void AssignIDToDefinition::visit(Reference &ope) {
     }
     ope.rule_->accept(*this);
   }
+  if (ope.instance_ && instances.insert(ope.instance_).second) {
+    ope.instance_->ope_->accept(*this);
+  }
 }
 
 inline void AssignIDToDefinition::visit(PrecedenceClimbing &ope) {
@@ -3070,6 +4489,34 @@ inline void AssignIDToDefinition::visit(PrecedenceClimbing &ope) {
   ope.binop_->accept(*this);
 }
 
+inline void FirstSet::visit(CharacterClass &ope) {
+  // Bytes from 0x80 start multi-byte characters.
+  chars_.reset();
+  nullable_ = false;
+  for (size_t b = 0; b < 256; b++) {
+    if (b >= 0x80 || ope.match(static_cast<char32_t>(b))) { chars_.set(b); }
+  }
+}
+
+inline void FirstSet::visit(Holder &ope) {
+  if (ope.outer_->enter || ope.outer_->leave || ope.outer_->is_macro ||
+      holders_.count(&ope)) {
+    return;
+  }
+  holders_.insert(&ope);
+  if (rules_ && std::find(rules_->begin(), rules_->end(), ope.outer_) ==
+                    rules_->end()) {
+    rules_->push_back(ope.outer_);
+  }
+  first(*ope.ope_);
+  holders_.erase(&ope);
+}
+
+inline void FirstSet::visit(Reference &ope) {
+  // Macro arguments are only known at parse time.
+  if (ope.rule_ && !ope.rule_->is_macro) { ope.rule_->accept(*this); }
+}
+
 inline void TokenChecker::visit(Reference &ope) {
   if (ope.is_macro_) {
     for (auto arg : ope.args_) {
@@ -3179,6 +4626,150 @@ inline void DetectInfiniteLoop::visit(Reference &ope) {
   }
 }
 
+inline void PerformanceLint::visit(Sequence &ope) {
+  for (size_t i = 0; i < ope.opes_.size(); i++) {
+    auto &op = *ope.opes_[i];
+    if (i > 0 && has_ws_class_ && !in_token_) {
+      auto prev = ope.opes_[i - 1].get();
+      auto lit = dynamic_cast<LiteralString *>(prev);
+      auto ref = dynamic_cast<Reference *>(&op);
+      std::bitset<128> chars;
+      if ((dynamic_cast<TokenBoundary *>(prev) || (lit && !lit->lit_.empty())) &&
+          ref && !ref->is_macro_ && skip_class(op, chars) &&
+          (chars & ~ws_class_).none()) {
+        messages.push_back("'" + ref->name_ +
+                           "' skips whitespace right after %whitespace did.");
+      }
+    }
+    op.accept(*this);
+  }
+}
+
+inline void PerformanceLint::visit(PrioritizedChoice &ope) {
+  std::vector<std::bitset<256>> first_sets;
+  std::vector<const std::string *> names;
+  for (auto op : ope.opes_) {
+    first_sets.push_back(FirstSet::chars(*op));
+    names.push_back(leading_rule(*op));
+  }
+
+  auto same_rule = [&](size_t i, size_t j) {
+    return names[i] && names[j] && *names[i] == *names[j];
+  };
+
+  for (size_t j = 1; j < ope.opes_.size(); j++) {
+    for (size_t i = 0; i < j; i++) {
+      if (same_rule(i, j)) {
+        if (std::none_of(names.begin(), names.begin() + i, [&](auto name) {
+              return name && *name == *names[i];
+            })) {
+          messages.push_back("'" + *names[i] +
+                             "' is parsed again at the same position by "
+                             "alternatives of a choice; packrat parsing or "
+                             "factoring it out would avoid that.");
+        }
+        break;
+      }
+    }
+  }
+
+  // Only ASCII is compared, since character classes can start with any byte
+  // from 0x80.
+  for (size_t j = 1; j < ope.opes_.size(); j++) {
+    for (size_t i = 0; i < j; i++) {
+      if (same_rule(i, j) || first_sets[i].all() || first_sets[j].all()) {
+        continue;
+      }
+      auto common = first_sets[i] & first_sets[j];
+      size_t b = 0;
+      while (b < 0x80 && !common[b]) {
+        b++;
+      }
+      if (b < 0x80) {
+        messages.push_back("alternatives " + std::to_string(i + 1) + " and " +
+                           std::to_string(j + 1) +
+                           " of a choice can both start with " +
+                           char_to_s(b) + ", so the input is backtracked.");
+        break;
+      }
+    }
+  }
+
+  for (auto op : ope.opes_) {
+    op->accept(*this);
+  }
+}
+
+inline void PerformanceLint::visit(Repetition &ope) {
+  if (auto choice = dynamic_cast<PrioritizedChoice *>(ope.ope_.get())) {
+    auto single = std::all_of(
+        choice->opes_.begin(), choice->opes_.end(), [](const auto &op) {
+          auto lit = dynamic_cast<LiteralString *>(op.get());
+          return (lit && lit->lit_.size() == 1) ||
+                 dynamic_cast<CharacterClass *>(op.get()) ||
+                 dynamic_cast<Character *>(op.get());
+        });
+    if (single) {
+      messages.push_back("a repetition of a choice of single characters "
+                         "would be faster as a character class.");
+    }
+  } else if (auto ref = dynamic_cast<Reference *>(ope.ope_.get());
+             ref && ref->rule_ && !ref->is_macro_ &&
+             dynamic_cast<CharacterClass *>(
+                 ref->rule_->get_core_operator().get())) {
+    messages.push_back("a repetition of '" + ref->name_ +
+                       "' would be faster with its character class inline.");
+  }
+  ope.ope_->accept(*this);
+}
+
+inline void PerformanceLint::visit(Holder &ope) {
+  if (ope.outer_->is_token()) { in_token_++; }
+  ope.ope_->accept(*this);
+  if (ope.outer_->is_token()) { in_token_--; }
+}
+
+inline const std::string *PerformanceLint::leading_rule(Ope &ope) {
+  if (auto seq = dynamic_cast<Sequence *>(&ope)) {
+    return seq->opes_.empty() ? nullptr : leading_rule(*seq->opes_[0]);
+  } else if (auto cap = dynamic_cast<Capture *>(&ope)) {
+    return leading_rule(*cap->ope_);
+  } else if (auto scope = dynamic_cast<CaptureScope *>(&ope)) {
+    return leading_rule(*scope->ope_);
+  } else if (auto tok = dynamic_cast<TokenBoundary *>(&ope)) {
+    return leading_rule(*tok->ope_);
+  } else if (auto ign = dynamic_cast<Ignore *>(&ope)) {
+    return leading_rule(*ign->ope_);
+  } else if (auto ref = dynamic_cast<Reference *>(&ope);
+             ref && ref->rule_ && !ref->is_macro_) {
+    return &ref->name_;
+  }
+  return nullptr;
+}
+
+inline bool PerformanceLint::skip_class(Ope &ope, std::bitset<128> &chars) {
+  if (auto ref = dynamic_cast<Reference *>(&ope)) {
+    return ref->rule_ && !ref->is_macro_ &&
+           skip_class(*ref->rule_->get_core_operator(), chars);
+  } else if (auto ws = dynamic_cast<Whitespace *>(&ope)) {
+    return skip_class(*ws->ope_, chars);
+  } else if (auto ign = dynamic_cast<Ignore *>(&ope)) {
+    return skip_class(*ign->ope_, chars);
+  } else if (auto holder = dynamic_cast<Holder *>(&ope)) {
+    return skip_class(*holder->ope_, chars);
+  } else if (auto weak = dynamic_cast<WeakHolder *>(&ope)) {
+    return skip_class(*weak->weak_.lock(), chars);
+  } else if (auto rep = dynamic_cast<Repetition *>(&ope); rep && !rep->min_) {
+    auto cls = dynamic_cast<CharacterClass *>(rep->ope_.get());
+    if (!cls) { return false; }
+    for (size_t b = 0; b < 128; b++) {
+      chars[b] = cls->match(static_cast<char32_t>(b));
+    }
+    return true;
+  }
+  return false;
+}
+
 inline void ReferenceChecker::visit(Reference &ope) {
   auto it = std::find(params_.begin(), params_.end(), ope.name_);
   if (it != params_.end()) { return; }
@@ -3228,7 +4819,7 @@ inline void LinkReferences::visit(Reference &ope) {
 }
 
 inline void FindReference::visit(Reference &ope) {
-  for (size_t i = 0; i < args_.size(); i++) {
+  for (size_t i = 0; i < params_.size(); i++) {
     const auto &name = params_[i];
     if (name == ope.name_) {
       found_ope = args_[i];
@@ -3238,6 +4829,479 @@ inline void FindReference::visit(Reference &ope) {
   found_ope = ope.shared_from_this();
 }
 
+inline void LowerOpe::visit(PrioritizedChoice &ope) {
+  if (ope.for_label_) {
+    lowered_ = false;
+    return;
+  }
+
+  auto choice = choice_;
+  std::vector<size_t> ends;
+  for (size_t id = 0; id < ope.opes_.size(); id++) {
+    auto &alt = *ope.opes_[id];
+    auto last = id + 1 == ope.opes_.size();
+
+    // An alternative which can't start with the next byte is skipped, as the
+    // operator does without a logger.
+    auto test = static_cast<size_t>(-1);
+    std::vector<const Definition *> rules;
+    auto chars = FirstSet::chars(alt, &rules);
+    if (!chars.all()) {
+      test = emit(Op::Test, 0, program_.first_sets.size());
+      program_.first_sets.push_back(chars);
+      program_.first_rules.push_back(std::move(rules));
+    }
+
+    auto next = last ? static_cast<size_t>(-1) : emit(Op::Choice);
+    lower(alt, false);
+    if (choice) { emit(Op::Choose, id, ope.opes_.size()); }
+
+    if (!last) {
+      ends.push_back(emit(Op::Commit));
+      program_.code[next].arg = here();
+      if (test != static_cast<size_t>(-1)) { program_.code[test].arg = here(); }
+    } else if (test != static_cast<size_t>(-1)) {
+      ends.push_back(emit(Op::Jump));
+      program_.code[test].arg = here();
+      emit(Op::Fail);
+    }
+  }
+
+  for (auto end : ends) {
+    program_.code[end].arg = here();
+  }
+}
+
+inline void LowerOpe::visit(Repetition &ope) {
+  if (ope.class_ || ope.any_char_) {
+    emit(Op::Span, 0, 0, &ope);
+    return;
+  }
+
+  // The counted repetitions are unrolled, so the long ones are left to the
+  // operator.
+  auto max = std::numeric_limits<size_t>::max();
+  if (ope.min_ > 16 || (ope.max_ != max && ope.max_ - ope.min_ > 16)) {
+    lowered_ = false;
+    return;
+  }
+
+  for (size_t i = 0; i < ope.min_; i++) {
+    lower(*ope.ope_, false);
+  }
+
+  if (ope.max_ == max) {
+    auto choice = emit(Op::Choice);
+    lower(*ope.ope_, false);
+    emit(Op::PartialCommit, choice + 1);
+    program_.code[choice].arg = here();
+  } else {
+    std::vector<size_t> choices;
+    for (auto i = ope.min_; i < ope.max_; i++) {
+      choices.push_back(emit(Op::Choice));
+      lower(*ope.ope_, false);
+      emit(Op::Commit, here() + 1);
+    }
+    for (auto choice : choices) {
+      program_.code[choice].arg = here();
+    }
+  }
+}
+
+inline void LowerOpe::visit(Holder &ope) {
+  if (ope.outer_->is_macro) {
+    lowered_ = false;
+    return;
+  }
+  emit(Op::Call, 0, 0, &ope);
+}
+
+inline void LowerOpe::visit(Reference &ope) {
+  if (!ope.rule_ || ope.rule_->is_macro) {
+    lowered_ = false;
+    return;
+  }
+  emit(Op::Call, 0, 0, ope.get_core_operator().get());
+}
+
+inline size_t Program::lower(Grammar &grammar, const std::string &start) {
+  auto program = std::make_shared<Program>();
+
+  auto lower_ope = [&](Ope &ope, size_t &entry) {
+    entry = program->code.size();
+    LowerOpe vis(*program);
+    if (vis.lower(ope)) { return true; }
+    program->code.resize(entry);
+    return false;
+  };
+
+  // The whitespace is `Ignore` in `Whitespace`, which `Space` takes care of.
+  if (auto ws = dynamic_cast<Whitespace *>(
+          grammar[start].whitespaceOpe.get())) {
+    if (auto ign = dynamic_cast<Ignore *>(ws->ope_.get());
+        ign && lower_ope(*ign->ope_, program->whitespace_entry_)) {
+      program->whitespace_ = ws;
+    }
+  }
+
+  std::vector<std::pair<Holder *, size_t>> lowered;
+  for (auto &[_, rule] : grammar) {
+    auto &holder = *rule.holder_;
+    holder.program_ = nullptr;
+    size_t entry = 0;
+    if (!rule.is_macro && holder.ope_ && lower_ope(*holder.ope_, entry)) {
+      lowered.emplace_back(&holder, entry);
+    }
+  }
+
+  for (auto [holder, entry] : lowered) {
+    holder->program_ = program;
+    holder->program_entry_ = entry;
+  }
+  return lowered.size();
+}
+
+inline size_t Program::parse(size_t pc, const char *s, size_t n,
+                             SemanticValues &vs, Context &c,
+                             std::any &dt) const {
+  // Marks of the token boundaries and the ignored values aren't choices.
+  constexpr auto mark = static_cast<size_t>(-1);
+
+  auto &stack = c.program_stack;
+  auto base = stack.size();
+  auto save_in_token_boundary_count = c.in_token_boundary_count;
+
+  auto p = s;
+  auto end = s + n;
+
+  auto push = [&](size_t a_pc) {
+    stack.push_back({a_pc, p, vs.size(), vs.tags.size(), vs.tokens.size(),
+                     c.capture_values.size(), c.in_token_boundary_count});
+  };
+
+  auto restore = [&](const Context::ProgramFrame &f) {
+    p = f.s;
+    vs.resize(f.values);
+    vs.tags.resize(f.tags);
+    vs.tokens.resize(f.tokens);
+    c.capture_values.resize(f.captures);
+  };
+
+  for (;;) {
+    const auto &in = code[pc];
+    auto ok = true;
+    pc++;
+
+    switch (in.op) {
+    case Op::Char:
+      ok = p < end && static_cast<uint8_t>(*p) == in.arg;
+      if (ok) { p++; }
+      break;
+    case Op::Any: {
+      auto len = codepoint_length(p, static_cast<size_t>(end - p));
+      ok = len > 0;
+      p += len;
+      break;
+    }
+    case Op::Class: {
+      auto &cls = static_cast<const CharacterClass &>(*in.ope);
+      auto len = cls.CharacterClass::parse_core(
+          p, static_cast<size_t>(end - p), vs, c, dt);
+      ok = success(len);
+      if (ok) { p += len; }
+      break;
+    }
+    case Op::Span: {
+      auto &rep = static_cast<const Repetition &>(*in.ope);
+      auto len = rep.parse_chars(p, static_cast<size_t>(end - p), c);
+      ok = success(len);
+      if (ok) { p += len; }
+      break;
+    }
+    case Op::Literal: {
+      auto &lit = static_cast<const LiteralString &>(*in.ope);
+      auto len = lit.lit_.size();
+      size_t i = 0;
+      if (static_cast<size_t>(end - p) >= len) {
+        while (i < len && (lit.ignore_case_
+                               ? std::tolower(p[i]) == std::tolower(lit.lit_[i])
+                               : p[i] == lit.lit_[i])) {
+          i++;
+        }
+      }
+      ok = i == len;
+      if (ok && c.wordOpe) {
+        std::call_once(lit.init_is_word_, [&]() {
+          lit.is_word_ = c.match_word(lit.lit_.data(), len);
+        });
+        ok = !lit.is_word_ ||
+             !c.match_word(p + len, static_cast<size_t>(end - p) - len);
+      }
+      if (ok) { p += len; }
+      break;
+    }
+    case Op::Dictionary: {
+      auto &dic = static_cast<const Dictionary &>(*in.ope);
+      auto len = dic.trie_.match(p, static_cast<size_t>(end - p));
+      ok = len > 0 && !(c.wordOpe && c.match_word(
+                                         p + len,
+                                         static_cast<size_t>(end - p) - len));
+      if (ok) { p += len; }
+      break;
+    }
+    case Op::Space:
+      if (!c.in_token_boundary_count && c.whitespaceOpe) {
+        auto len = c.whitespaceOpe.get() == whitespace_
+                       ? parse_whitespace(p, static_cast<size_t>(end - p), c,
+                                          dt)
+                       : c.whitespaceOpe->parse(
+                             p, static_cast<size_t>(end - p), vs, c, dt);
+        ok = success(len);
+        if (ok) { p += len; }
+      }
+      break;
+    case Op::Call: {
+      auto &holder = static_cast<const Holder &>(*in.ope);
+      auto len = holder.Holder::parse_core(p, static_cast<size_t>(end - p), vs,
+                                           c, dt);
+      ok = success(len);
+      if (ok) { p += len; }
+      break;
+    }
+    case Op::Test:
+      if (p < end && !first_sets[in.arg2][static_cast<uint8_t>(*p)] &&
+          !has_handlers(first_rules[in.arg2])) {
+        pc = in.arg;
+      }
+      break;
+    case Op::Choice: push(in.arg); break;
+    case Op::Commit:
+      stack.pop_back();
+      pc = in.arg;
+      break;
+    case Op::PartialCommit: {
+      auto &f = stack.back();
+      f.s = p;
+      f.values = vs.size();
+      f.tags = vs.tags.size();
+      f.tokens = vs.tokens.size();
+      f.captures = c.capture_values.size();
+      pc = in.arg;
+      break;
+    }
+    case Op::BackCommit:
+      restore(stack.back());
+      stack.pop_back();
+      pc = in.arg;
+      break;
+    case Op::FailTwice:
+      stack.pop_back();
+      ok = false;
+      break;
+    case Op::Fail: ok = false; break;
+    case Op::Jump: pc = in.arg; break;
+    case Op::TokenBegin:
+      push(mark);
+      c.in_token_boundary_count++;
+      break;
+    case Op::TokenEnd: {
+      c.in_token_boundary_count--;
+      auto token_s = stack.back().s;
+      vs.tokens.emplace_back(token_s, static_cast<size_t>(p - token_s));
+      stack.pop_back();
+      break;
+    }
+    case Op::IgnoreBegin: push(mark); break;
+    case Op::IgnoreEnd: {
+      const auto &f = stack.back();
+      vs.resize(f.values);
+      vs.tags.resize(f.tags);
+      vs.tokens.resize(f.tokens);
+      stack.pop_back();
+      break;
+    }
+    case Op::Choose:
+      vs.choice_count_ = in.arg2;
+      vs.choice_ = in.arg;
+      break;
+    case Op::Return: return static_cast<size_t>(p - s);
+    }
+
+    if (ok) { continue; }
+
+    // Backtrack to the last choice of this rule, or fail the rule.
+    while (stack.size() > base && stack.back().pc == mark) {
+      stack.pop_back();
+    }
+    if (stack.size() == base) {
+      c.in_token_boundary_count = save_in_token_boundary_count;
+      return static_cast<size_t>(-1);
+    }
+    const auto &f = stack.back();
+    restore(f);
+    c.in_token_boundary_count = f.in_token_boundary_count;
+    pc = f.pc;
+    stack.pop_back();
+  }
+}
+
+inline size_t Program::parse_whitespace(const char *s, size_t n, Context &c,
+                                        std::any &dt) const {
+  if (c.in_whitespace) { return 0; }
+  c.in_whitespace = true;
+  auto &vs = c.push_semantic_values_scope();
+  auto se = scope_exit([&]() {
+    c.pop_semantic_values_scope();
+    c.in_whitespace = false;
+  });
+  return parse(whitespace_entry_, s, n, vs, c, dt);
+}
+
+// Binds the macro calls of a grammar, whose arguments are known when it's
+// loaded, to instances of the macros. An instance is the macro body with the
+// parameters replaced by the arguments, so that parsing doesn't resolve the
+// arguments of each call. The parts which don't refer to parameters are
+// shared with the macro body.
+class InstantiateMacros : public Ope::Visitor {
+public:
+  static void instantiate(Grammar &grammar) {
+    std::vector<const Definition *> building;
+    for (auto &[_, rule] : grammar) {
+      if (rule.is_macro) { continue; }
+      InstantiateMacros vis(nullptr, building);
+      vis.substitute(rule.get_core_operator());
+    }
+  }
+
+  void visit(Sequence &ope) override {
+    std::vector<std::shared_ptr<Ope>> opes;
+    if (substitute(ope.opes_, opes)) {
+      changed_ = std::make_shared<Sequence>(std::move(opes));
+    }
+  }
+  void visit(PrioritizedChoice &ope) override {
+    std::vector<std::shared_ptr<Ope>> opes;
+    if (substitute(ope.opes_, opes)) {
+      auto choice = std::make_shared<PrioritizedChoice>(std::move(opes));
+      choice->for_label_ = ope.for_label_;
+      changed_ = choice;
+    }
+  }
+  void visit(Repetition &ope) override {
+    unary(ope.ope_, [&](auto o) { return rep(o, ope.min_, ope.max_); });
+  }
+  void visit(AndPredicate &ope) override { unary(ope.ope_, apd); }
+  void visit(NotPredicate &ope) override { unary(ope.ope_, npd); }
+  void visit(CaptureScope &ope) override { unary(ope.ope_, csc); }
+  void visit(Capture &ope) override {
+    unary(ope.ope_, [&](auto o) {
+      return std::make_shared<Capture>(o, ope.match_action_, ope.name_);
+    });
+  }
+  void visit(TokenBoundary &ope) override { unary(ope.ope_, tok); }
+  void visit(Ignore &ope) override { unary(ope.ope_, ign); }
+  void visit(Reference &ope) override;
+  void visit(Whitespace &ope) override { unary(ope.ope_, wsp); }
+  void visit(PrecedenceClimbing &ope) override {
+    // Only a rule body is a precedence climbing, and macros with one aren't
+    // instantiated.
+    substitute(ope.atom_);
+    substitute(ope.binop_);
+    changed_ = nullptr;
+  }
+  void visit(Recovery &ope) override { unary(ope.ope_, rec); }
+
+private:
+  InstantiateMacros(const std::vector<std::shared_ptr<Ope>> *args,
+                    std::vector<const Definition *> &building)
+      : args_(args), building_(building) {}
+
+  std::shared_ptr<Ope> substitute(const std::shared_ptr<Ope> &ope) {
+    changed_ = nullptr;
+    ope->accept(*this);
+    auto ret = changed_ ? changed_ : ope;
+    changed_ = nullptr;
+    return ret;
+  }
+
+  // Whether any of `opes` changed, which are put in `ret` with the parameters
+  // replaced
+  bool substitute(const std::vector<std::shared_ptr<Ope>> &opes,
+                  std::vector<std::shared_ptr<Ope>> &ret) {
+    auto changed = false;
+    for (const auto &ope : opes) {
+      ret.push_back(substitute(ope));
+      if (ret.back() != ope) { changed = true; }
+    }
+    return changed;
+  }
+
+  template <typename T> void unary(const std::shared_ptr<Ope> &ope, T make) {
+    auto o = substitute(ope);
+    if (o != ope) { changed_ = make(o); }
+  }
+
+  Holder *instance(Definition &rule,
+                   const std::vector<std::shared_ptr<Ope>> &args);
+
+  const std::vector<std::shared_ptr<Ope>> *args_;
+  // Macros whose instances are being made. A macro which calls itself with
+  // other arguments isn't instantiated again, as that may never end.
+  std::vector<const Definition *> &building_;
+  std::shared_ptr<Ope> changed_;
+};
+
+inline void InstantiateMacros::visit(Reference &ope) {
+  if (!ope.rule_) {
+    // Parameter
+    if (args_) { changed_ = (*args_)[ope.iarg_]; }
+    return;
+  }
+  if (!ope.rule_->is_macro) { return; }
+
+  std::vector<std::shared_ptr<Ope>> args;
+  auto changed = substitute(ope.args_, args);
+  auto holder = instance(*ope.rule_, args);
+  if (changed) {
+    auto ref = std::make_shared<Reference>(ope.grammar_, ope.name_, ope.s_,
+                                           true, args);
+    ref->rule_ = ope.rule_;
+    ref->instance_ = holder;
+    ref->args_resolved_ = true;
+    changed_ = ref;
+  } else {
+    if (holder) { ope.instance_ = holder; }
+    ope.args_resolved_ = true;
+  }
+}
+
+inline Holder *
+InstantiateMacros::instance(Definition &rule,
+                            const std::vector<std::shared_ptr<Ope>> &args) {
+  std::vector<const Ope *> key;
+  for (const auto &arg : args) {
+    key.push_back(arg.get());
+  }
+  auto it = rule.instances.find(key);
+  if (it != rule.instances.end()) { return it->second.get(); }
+
+  auto ope = rule.get_core_operator();
+  if (dynamic_cast<PrecedenceClimbing *>(ope.get()) ||
+      std::count(building_.begin(), building_.end(), &rule)) {
+    return nullptr;
+  }
+
+  // The instance is registered first, so that the calls with the same
+  // arguments in the body use it.
+  auto holder = std::make_shared<Holder>(&rule);
+  rule.instances.emplace(std::move(key), holder);
+  building_.push_back(&rule);
+  InstantiateMacros vis(&args, building_);
+  holder->ope_ = vis.substitute(ope);
+  building_.pop_back();
+  return holder.get();
+}
+
 /*-----------------------------------------------------------------------------
  *  PEG parser generator
  *---------------------------------------------------------------------------*/
@@ -3322,8 +5386,9 @@ private:
             seq(g["OPEN"], g["Expression"], g["CLOSE"]),
             seq(g["BeginTok"], g["Expression"], g["EndTok"]), g["CapScope"],
             seq(g["BeginCap"], g["Expression"], g["EndCap"]), g["BackRef"],
-            g["LiteralI"], g["Dictionary"], g["Literal"], g["NegatedClassI"],
-            g["NegatedClass"], g["ClassI"], g["Class"], g["DOT"]);
+            g["DictionaryI"], g["LiteralI"], g["Dictionary"], g["Literal"],
+            g["NegatedClassI"], g["NegatedClass"], g["ClassI"], g["Class"],
+            g["DOT"]);
 
     g["Identifier"] <= seq(g["IdentCont"], g["Spacing"]);
     g["IdentCont"] <= seq(g["IdentStart"], zom(g["IdentRest"]));
@@ -3337,6 +5402,9 @@ private:
 
     g["Dictionary"] <= seq(g["LiteralD"], oom(seq(g["PIPE"], g["LiteralD"])));
 
+    g["DictionaryI"] <=
+        seq(g["LiteralID"], oom(seq(g["PIPE"], g["LiteralID"])));
+
     auto lit_ope = cho(seq(cls("'"), tok(zom(seq(npd(cls("'")), g["Char"]))),
                            cls("'"), g["Spacing"]),
                        seq(cls("\""), tok(zom(seq(npd(cls("\"")), g["Char"]))),
@@ -3344,11 +5412,13 @@ private:
     g["Literal"] <= lit_ope;
     g["LiteralD"] <= lit_ope;
 
-    g["LiteralI"] <=
+    auto liti_ope =
         cho(seq(cls("'"), tok(zom(seq(npd(cls("'")), g["Char"]))), lit("'i"),
                 g["Spacing"]),
             seq(cls("\""), tok(zom(seq(npd(cls("\"")), g["Char"]))), lit("\"i"),
                 g["Spacing"]));
+    g["LiteralI"] <= liti_ope;
+    g["LiteralID"] <= liti_ope;
 
     // NOTE: The original Brian Ford's paper uses 'zom' instead of 'oom'.
     g["Class"] <= seq(chr('['), npd(chr('^')),
@@ -3439,7 +5509,8 @@ private:
                                                   g["InstructionItem"])))),
             g["EndBlacket"]);
     g["InstructionItem"] <=
-        cho(g["PrecedenceClimbing"], g["ErrorMessage"], g["NoAstOpt"]);
+        cho(g["PrecedenceClimbing"], g["ErrorMessage"], g["NoAstOpt"],
+            g["NoPackrat"]);
     ~g["InstructionItemSeparator"] <= seq(chr(';'), g["Spacing"]);
 
     ~g["SpacesZom"] <= zom(g["Space"]);
@@ -3472,6 +5543,9 @@ private:
     // No Ast node optimazation instruction
     g["NoAstOpt"] <= seq(lit("no_ast_opt"), g["SpacesZom"]);
 
+    // No packrat memoization instruction
+    g["NoPackrat"] <= seq(lit("no_packrat"), g["SpacesZom"]);
+
     // Set definition names
     for (auto &x : g) {
       x.second.name = x.first;
@@ -3682,10 +5756,7 @@ private:
         data.captures_stack.back().insert(name);
         data.captures_in_current_definition.insert(name);
 
-        return cap(ope, [name](const char *a_s, size_t a_n, Context &c) {
-          auto &cs = c.capture_scope_stack[c.capture_scope_stack_size - 1];
-          cs[name] = std::string(a_s, a_n);
-        });
+        return cap(ope, name);
       }
       default: {
         return std::any_cast<std::shared_ptr<Ope>>(vs[0]);
@@ -3702,6 +5773,11 @@ private:
       return dic(items);
     };
 
+    g["DictionaryI"] = [](const SemanticValues &vs) {
+      auto items = vs.transform<std::string>();
+      return dic(items, true);
+    };
+
     g["Literal"] = [](const SemanticValues &vs) {
       const auto &tok = vs.tokens.front();
       return lit(resolve_escape_sequence(tok.data(), tok.size()));
@@ -3714,6 +5790,10 @@ private:
       auto &tok = vs.tokens.front();
       return resolve_escape_sequence(tok.data(), tok.size());
     };
+    g["LiteralID"] = [](const SemanticValues &vs) {
+      auto &tok = vs.tokens.front();
+      return resolve_escape_sequence(tok.data(), tok.size());
+    };
 
     g["Class"] = [](const SemanticValues &vs) {
       auto ranges = vs.transform<std::pair<char32_t, char32_t>>();
@@ -3877,6 +5957,13 @@ private:
       return instruction;
     };
 
+    g["NoPackrat"] = [](const SemanticValues &vs) {
+      Instruction instruction;
+      instruction.type = "no_packrat";
+      instruction.sv = vs.sv();
+      return instruction;
+    };
+
     g["Instruction"] = [](const SemanticValues &vs) {
       return vs.transform<Instruction>();
     };
@@ -4130,10 +6217,14 @@ private:
           rule.error_message = std::any_cast<std::string>(instruction.data);
         } else if (instruction.type == "no_ast_opt") {
           rule.no_ast_opt = true;
+        } else if (instruction.type == "no_packrat") {
+          rule.no_packrat = true;
         }
       }
     }
 
+    InstantiateMacros::instantiate(grammar);
+
     // Set root definition
     start = data.start;
     enablePackratParsing = data.enablePackratParsing;
@@ -4165,40 +6256,105 @@ private:
  *  AST
  *---------------------------------------------------------------------------*/
 
+// The index for the nodes made with a line and a column. The nodes made one
+// after another on a thread share it, unless the path changes or a position
+// is found at two places.
+inline std::shared_ptr<const LineIndex>
+placed_line_index(const char *path, size_t line, size_t column,
+                  size_t position) {
+  thread_local std::weak_ptr<const LineIndex> last;
+  auto line_index = last.lock();
+  if (!line_index || line_index->path != (path ? path : "") ||
+      !line_index->put(position, line, column)) {
+    auto index = std::make_shared<LineIndex>(path);
+    index->put(position, line, column);
+    line_index = index;
+    last = line_index;
+  }
+  return line_index;
+}
+
 template <typename Annotation> struct AstBase : public Annotation {
   AstBase(const char *path, size_t line, size_t column, const char *name,
           const std::vector<std::shared_ptr<AstBase>> &nodes,
           size_t position = 0, size_t length = 0, size_t choice_count = 0,
           size_t choice = 0)
-      : path(path ? path : ""), line(line), column(column), name(name),
-        position(position), length(length), choice_count(choice_count),
-        choice(choice), original_name(name),
+      : line_index(placed_line_index(path, line, column, position)),
+        name(name), position(position), length(length),
+        choice_count(choice_count), choice(choice), original_name(name),
         original_choice_count(choice_count), original_choice(choice),
-        tag(str2tag(name)), original_tag(tag), is_token(false), nodes(nodes) {}
+        tag(str2tag(name)), original_tag(tag), is_token(false),
+        nodes(nodes.begin(), nodes.end()) {}
 
   AstBase(const char *path, size_t line, size_t column, const char *name,
           const std::string_view &token, size_t position = 0, size_t length = 0,
           size_t choice_count = 0, size_t choice = 0)
-      : path(path ? path : ""), line(line), column(column), name(name),
-        position(position), length(length), choice_count(choice_count),
-        choice(choice), original_name(name),
+      : line_index(placed_line_index(path, line, column, position)),
+        name(name), position(position), length(length),
+        choice_count(choice_count), choice(choice), original_name(name),
         original_choice_count(choice_count), original_choice(choice),
         tag(str2tag(name)), original_tag(tag), is_token(true), token(token) {}
 
+  // Nodes of `rule`, which take the tag and the id computed for the rule
+  AstBase(const std::shared_ptr<const LineIndex> &line_index,
+          const Definition &rule,
+          const std::vector<std::shared_ptr<AstBase>> &nodes,
+          size_t position = 0, size_t length = 0, size_t choice_count = 0,
+          size_t choice = 0)
+      : line_index(line_index), name(rule.name),
+        position(position), length(length), choice_count(choice_count),
+        choice(choice), original_name(rule.name),
+        original_choice_count(choice_count), original_choice(choice),
+        tag(rule.tag), original_tag(tag), rule_id(rule.rule_id),
+        original_rule_id(rule_id), is_token(false),
+        nodes(nodes.begin(), nodes.end()) {}
+
+  AstBase(const std::shared_ptr<const LineIndex> &line_index,
+          const Definition &rule, const std::string_view &token,
+          size_t position = 0, size_t length = 0, size_t choice_count = 0,
+          size_t choice = 0)
+      : line_index(line_index), name(rule.name),
+        position(position), length(length), choice_count(choice_count),
+        choice(choice), original_name(rule.name),
+        original_choice_count(choice_count), original_choice(choice),
+        tag(rule.tag), original_tag(tag), rule_id(rule.rule_id),
+        original_rule_id(rule_id), is_token(true), token(token) {}
+
   AstBase(const AstBase &ast, const char *original_name, size_t position = 0,
           size_t length = 0, size_t original_choice_count = 0,
           size_t original_choice = 0)
-      : path(ast.path), line(ast.line), column(ast.column), name(ast.name),
+      : line_index(ast.line_index), name(ast.name),
         position(position), length(length), choice_count(ast.choice_count),
         choice(ast.choice), original_name(original_name),
         original_choice_count(original_choice_count),
         original_choice(original_choice), tag(ast.tag),
-        original_tag(str2tag(original_name)), is_token(ast.is_token),
-        token(ast.token), nodes(ast.nodes), parent(ast.parent) {}
+        original_tag(str2tag(original_name)), rule_id(ast.rule_id),
+        is_token(ast.is_token), token(ast.token), nodes(ast.nodes),
+        parent(ast.parent), source(ast.source) {}
 
-  const std::string path;
-  const size_t line = 1;
-  const size_t column = 1;
+  AstBase(const AstBase &ast, const AstBase &original, size_t position = 0,
+          size_t length = 0, size_t original_choice_count = 0,
+          size_t original_choice = 0)
+      : line_index(ast.line_index), name(ast.name),
+        position(position), length(length), choice_count(ast.choice_count),
+        choice(ast.choice), original_name(original.name),
+        original_choice_count(original_choice_count),
+        original_choice(original_choice), tag(ast.tag),
+        original_tag(original.tag), rule_id(ast.rule_id),
+        original_rule_id(original.rule_id), is_token(ast.is_token),
+        token(ast.token), nodes(ast.nodes), parent(ast.parent),
+        source(ast.source) {}
+
+  // Finds the line and the column of `position` on demand. It is shared by
+  // the nodes of a parse.
+  std::shared_ptr<const LineIndex> line_index;
+
+  const std::string &path() const { return line_index->path; }
+  std::pair<size_t, size_t> line_info() const {
+    return line_index->line_info(position);
+  }
+  size_t line() const { return line_info().first; }
+  size_t column() const { return line_info().second; }
 
   const std::string name;
   size_t position;
@@ -4210,13 +6366,22 @@ template <typename Annotation> struct AstBase : public Annotation {
   const size_t original_choice;
   const unsigned int tag;
   const unsigned int original_tag;
+  // `Definition::rule_id` of the rules, which visitors can switch on
+  const size_t rule_id = std::numeric_limits<size_t>::max();
+  const size_t original_rule_id = std::numeric_limits<size_t>::max();
 
   const bool is_token;
-  const std::string_view token;
+  std::string_view token;
 
-  std::vector<std::shared_ptr<AstBase<Annotation>>> nodes;
+  // The children of an arena AST are in the arena too.
+  using Nodes = std::vector<std::shared_ptr<AstBase<Annotation>>,
+                            AstArenaAllocator<std::shared_ptr<AstBase>>>;
+  Nodes nodes;
   std::weak_ptr<AstBase<Annotation>> parent;
 
+  // Keeps the input which `token` refers to alive, if set
+  std::shared_ptr<const void> source;
+
   std::string token_to_string() const {
     assert(is_token);
     return std::string(token);
@@ -4268,24 +6433,27 @@ struct AstOptimizer {
   template <typename T>
   std::shared_ptr<T> optimize(std::shared_ptr<T> original,
                               std::shared_ptr<T> parent = nullptr) {
-    auto found =
-        std::find(rules_.begin(), rules_.end(), original->name) != rules_.end();
+    auto found = !rules_.empty() && std::find(rules_.begin(), rules_.end(),
+                                              original->name) != rules_.end();
     auto opt = mode_ ? !found : found;
 
     if (opt && original->nodes.size() == 1) {
       auto child = optimize(original->nodes[0], parent);
-      auto ast = std::make_shared<T>(*child, original->name.data(),
-                                     original->choice_count, original->position,
-                                     original->length, original->choice);
+      // The length has always been passed as `original_choice_count`, and
+      // `ast_to_s` shows the choice of a collapsed node by it.
+      auto ast = std::make_shared<T>(*child, *original, original->position,
+                                     original->length, original->length,
+                                     original->choice);
       for (auto node : ast->nodes) {
         node->parent = ast;
       }
       return ast;
     }
 
+    // The copy doesn't use the arena of an arena AST.
     auto ast = std::make_shared<T>(*original);
     ast->parent = parent;
-    ast->nodes.clear();
+    ast->nodes = typename T::Nodes();
     for (auto node : original->nodes) {
       auto child = optimize(node, ast);
       ast->nodes.push_back(child);
@@ -4301,22 +6469,59 @@ private:
 struct EmptyType {};
 using Ast = AstBase<EmptyType>;
 
-template <typename T = Ast> void add_ast_action(Definition &rule) {
-  rule.action = [&](const SemanticValues &vs) {
-    auto line = vs.line_info();
+// The root returned holds the arena, and frees its nodes before the arena.
+template <typename Annotation>
+void keep_ast_arena(std::shared_ptr<AstBase<Annotation>> &ast,
+                    const std::shared_ptr<AstArena> &arena) {
+  if (!ast || !arena) { return; }
+  struct Root {
+    std::shared_ptr<AstArena> arena;
+    std::shared_ptr<AstBase<Annotation>> ast;
+  };
+  auto root = std::make_shared<Root>(Root{arena, std::move(ast)});
+  ast = std::shared_ptr<AstBase<Annotation>>(root, root->ast.get());
+}
+
+template <typename T, typename... Args>
+std::shared_ptr<T> make_ast(AstArena *arena, Args &&...args) {
+  if (arena) {
+    return std::allocate_shared<T>(AstArenaAllocator<T>(arena),
+                                   std::forward<Args>(args)...);
+  }
+  return std::make_shared<T>(std::forward<Args>(args)...);
+}
+
+// With `optimize`, a node which has only one child is replaced with the
+// child as `AstOptimizer` does, so that no second tree has to be built.
+template <typename T = Ast>
+void add_ast_action(Definition &rule, bool use_arena = false,
+                    bool optimize = false) {
+  rule.action = [&rule, use_arena, optimize](const SemanticValues &vs) {
+    auto line_index = vs.line_index();
+    auto arena = use_arena ? vs.ast_arena().get() : nullptr;
 
     if (rule.is_token()) {
-      return std::make_shared<T>(
-          vs.path, line.first, line.second, rule.name.data(), vs.token(),
-          std::distance(vs.ss, vs.sv().data()), vs.sv().length(),
-          vs.choice_count(), vs.choice());
+      return make_ast<T>(arena, line_index, rule, vs.token(),
+                         std::distance(vs.ss, vs.sv().data()),
+                         vs.sv().length(), vs.choice_count(), vs.choice());
     }
 
-    auto ast =
-        std::make_shared<T>(vs.path, line.first, line.second, rule.name.data(),
-                            vs.transform<std::shared_ptr<T>>(),
-                            std::distance(vs.ss, vs.sv().data()),
-                            vs.sv().length(), vs.choice_count(), vs.choice());
+    auto ast = make_ast<T>(arena, line_index, rule,
+                           std::vector<std::shared_ptr<T>>(),
+                           std::distance(vs.ss, vs.sv().data()),
+                           vs.sv().length(), vs.choice_count(), vs.choice());
+    ast->nodes = typename T::Nodes(arena);
+    ast->nodes.reserve(vs.size());
+    for (const auto &v : vs) {
+      ast->nodes.push_back(std::any_cast<std::shared_ptr<T>>(v));
+    }
+
+    // The copy of the child keeps the allocator of its children.
+    if (optimize && ast->nodes.size() == 1) {
+      const auto &child = *ast->nodes[0];
+      ast = make_ast<T>(arena, child, *ast, ast->position, ast->length,
+                        ast->length, ast->choice);
+    }
 
     for (auto node : ast->nodes) {
       node->parent = ast;
@@ -4456,10 +6661,834 @@ template <typename T = Ast> void add_ast_action(Definition &rule) {
 #define AST_DEFINITIONS(...)                                                   \
   PEG_EXPAND(PEG_CONCAT2(PEG_DEF_, PEG_COUNT(__VA_ARGS__))(__VA_ARGS__))
 
+/*-----------------------------------------------------------------------------
+ *  C++ code generator
+ *---------------------------------------------------------------------------*/
+
+inline std::string octal_escape(unsigned char c) {
+  std::string str = "\\";
+  str += static_cast<char>('0' + ((c >> 6) & 7));
+  str += static_cast<char>('0' + ((c >> 3) & 7));
+  str += static_cast<char>('0' + (c & 7));
+  return str;
+}
+
+inline std::string cpp_string_literal(std::string_view sv) {
+  std::string str = "\"";
+  for (auto ch : sv) {
+    auto c = static_cast<unsigned char>(ch);
+    switch (c) {
+    case '"': str += "\\\""; break;
+    case '\\': str += "\\\\"; break;
+    case '\n': str += "\\n"; break;
+    case '\r': str += "\\r"; break;
+    case '\t': str += "\\t"; break;
+    default:
+      if (c < 0x20 || c >= 0x7f) {
+        // Octal escapes take at most three digits, so that the following
+        // characters can't be taken as a part of the escape.
+        str += octal_escape(c);
+      } else {
+        str += ch;
+      }
+      break;
+    }
+  }
+  str += "\"";
+  return str;
+}
+
+inline std::string cpp_char_literal(char ch) {
+  auto c = static_cast<unsigned char>(ch);
+  switch (c) {
+  case '\'': return "'\\''";
+  case '\\': return "'\\\\'";
+  default:
+    if (c < 0x20 || c >= 0x7f) { return "'" + octal_escape(c) + "'"; }
+    return std::string("'") + ch + "'";
+  }
+}
+
+struct CppGenerator : public Ope::Visitor {
+  CppGenerator(const Grammar &grammar) : grammar_(grammar) {}
+
+  void visit(Sequence &ope) override { list("seq", ope.opes_); }
+  void visit(PrioritizedChoice &ope) override {
+    list(ope.for_label_ ? "cho4label_" : "cho", ope.opes_);
+  }
+  void visit(Repetition &ope) override {
+    auto max = std::numeric_limits<size_t>::max();
+    if (ope.min_ == 0 && ope.max_ == max) {
+      unary("zom", ope.ope_);
+    } else if (ope.min_ == 1 && ope.max_ == max) {
+      unary("oom", ope.ope_);
+    } else if (ope.min_ == 0 && ope.max_ == 1) {
+      unary("opt", ope.ope_);
+    } else {
+      code += "rep(";
+      ope.ope_->accept(*this);
+      code += ", " + std::to_string(ope.min_) + ", ";
+      code += ope.max_ == max ? "std::numeric_limits<size_t>::max()"
+                              : std::to_string(ope.max_);
+      code += ")";
+    }
+  }
+  void visit(AndPredicate &ope) override { unary("apd", ope.ope_); }
+  void visit(NotPredicate &ope) override { unary("npd", ope.ope_); }
+  void visit(Dictionary &ope) override {
+    code += "dic({";
+    auto first = true;
+    for (const auto &item : ope.trie_.items()) {
+      if (!first) { code += ", "; }
+      code += cpp_string_literal(item);
+      first = false;
+    }
+    code += ope.trie_.ignore_case() ? "}, true)" : "})";
+  }
+  void visit(LiteralString &ope) override {
+    code += ope.ignore_case_ ? "liti(" : "lit(";
+    code += cpp_string_literal(ope.lit_) + ")";
+  }
+  void visit(CharacterClass &ope) override {
+    code += ope.negated_ ? "ncls(" : "cls(";
+    code += "std::vector<std::pair<char32_t, char32_t>>{";
+    auto first = true;
+    for (const auto &[cp1, cp2] : ope.ranges_) {
+      if (!first) { code += ", "; }
+      code += "{" + std::to_string(static_cast<uint32_t>(cp1)) + ", " +
+              std::to_string(static_cast<uint32_t>(cp2)) + "}";
+      first = false;
+    }
+    code += "}";
+    if (ope.ignore_case_) { code += ", true"; }
+    code += ")";
+  }
+  void visit(Character &ope) override {
+    code += "chr(" + cpp_char_literal(ope.ch_) + ")";
+  }
+  void visit(AnyCharacter & /*ope*/) override { code += "dot()"; }
+  void visit(CaptureScope &ope) override { unary("csc", ope.ope_); }
+  void visit(Capture &ope) override {
+    // A user provided match action can't be written out.
+    if (ope.name_.empty()) { ret = false; }
+    code += "cap(";
+    ope.ope_->accept(*this);
+    code += ", " + cpp_string_literal(ope.name_) + ")";
+  }
+  void visit(TokenBoundary &ope) override { unary("tok", ope.ope_); }
+  void visit(Ignore &ope) override { unary("ign", ope.ope_); }
+  void visit(User & /*ope*/) override { ret = false; }
+  void visit(WeakHolder &ope) override { ope.weak_.lock()->accept(*this); }
+  void visit(Holder &ope) override {
+    // A definition used as an operator works as a reference to it.
+    if (!grammar_.count(ope.outer_->name)) { ret = false; }
+    code += "ref(g, " + cpp_string_literal(ope.outer_->name) +
+            ", \"\", false, {})";
+  }
+  void visit(Reference &ope) override {
+    code += "ref(g, " + cpp_string_literal(ope.name_) + ", \"\", ";
+    code += ope.is_macro_ ? "true, {" : "false, {";
+    auto first = true;
+    for (const auto &arg : ope.args_) {
+      if (!first) { code += ", "; }
+      arg->accept(*this);
+      first = false;
+    }
+    code += "})";
+  }
+  void visit(Whitespace &ope) override {
+    auto ign = dynamic_cast<Ignore *>(ope.ope_.get());
+    if (!ign) {
+      ret = false;
+      return;
+    }
+    unary("wsp", ign->ope_);
+  }
+  void visit(BackReference &ope) override {
+    code += "bkr(" + cpp_string_literal(ope.name_) + ")";
+  }
+  void visit(PrecedenceClimbing &ope) override {
+    code += "pre(";
+    ope.atom_->accept(*this);
+    code += ", ";
+    ope.binop_->accept(*this);
+    code += ", {";
+    auto first = true;
+    for (size_t i = 0; i < ope.tokens_.size(); i++) {
+      const auto &[level, assoc] = ope.levels_[i];
+      if (!first) { code += ", "; }
+      code += "{" + cpp_string_literal(ope.tokens_[i]) + ", {" +
+              std::to_string(level) + ", " + cpp_char_literal(assoc) + "}}";
+      first = false;
+    }
+    code += "}, rule)";
+  }
+  void visit(Recovery &ope) override { unary("rec", ope.ope_); }
+  void visit(Cut & /*ope*/) override { code += "cut()"; }
+
+  std::string code;
+  bool ret = true;
+
+private:
+  void unary(const char *fn, const std::shared_ptr<Ope> &ope) {
+    code += fn;
+    code += "(";
+    ope->accept(*this);
+    code += ")";
+  }
+
+  void list(const char *fn, const std::vector<std::shared_ptr<Ope>> &opes) {
+    code += fn;
+    code += "(";
+    auto first = true;
+    for (const auto &ope : opes) {
+      if (!first) { code += ", "; }
+      ope->accept(*this);
+      first = false;
+    }
+    code += ")";
+  }
+
+  const Grammar &grammar_;
+};
+
+// Generate a C++ header which defines `bool load_<name>_grammar(parser &)`.
+// The function builds the grammar with the operator factories, so that no
+// grammar text is parsed at run time. The operators are the same as the ones
+// `load_grammar` builds, and the rules aren't emitted as C++ functions. An empty string is returned when the
+// grammar contains operators which can't be written out such as `usr`.
+inline std::string generate_cpp(const Grammar &grammar,
+                                const std::string &start,
+                                bool enablePackratParsing,
+                                const std::string &name) {
+  auto ope_to_cpp = [&](Ope &ope, std::string &code) {
+    CppGenerator vis(grammar);
+    ope.accept(vis);
+    code = vis.code;
+    return vis.ret;
+  };
+
+  // Sort definitions by name for a stable output.
+  std::vector<std::string> rule_names;
+  for (const auto &[rule_name, _] : grammar) {
+    rule_names.push_back(rule_name);
+  }
+  std::sort(rule_names.begin(), rule_names.end());
+
+  std::string out;
+  out += "// This file was generated from a PEG grammar. Do not edit.\n\n";
+  out += "#pragma once\n\n";
+  out += "#include <peglib.h>\n\n";
+  out += "inline bool load_" + name + "_grammar(peg::parser &parser) {\n";
+  out += "  using namespace peg;\n\n";
+  out += "  auto grammar = std::make_shared<Grammar>();\n";
+  out += "  auto &g = *grammar;\n";
+
+  for (const auto &rule_name : rule_names) {
+    const auto &rule = grammar.at(rule_name);
+    std::string code;
+    if (!ope_to_cpp(*rule.get_core_operator(), code)) { return std::string(); }
+
+    out += "\n  {\n";
+    out += "    auto &rule = g[" + cpp_string_literal(rule_name) + "];\n";
+    out += "    rule.name = " + cpp_string_literal(rule_name) + ";\n";
+    out += "    rule <= " + code + ";\n";
+    if (rule.ignoreSemanticValue) {
+      out += "    rule.ignoreSemanticValue = true;\n";
+    }
+    if (rule.is_macro) {
+      out += "    rule.is_macro = true;\n";
+      out += "    rule.params = {";
+      for (size_t i = 0; i < rule.params.size(); i++) {
+        if (i > 0) { out += ", "; }
+        out += cpp_string_literal(rule.params[i]);
+      }
+      out += "};\n";
+    }
+    if (rule.disable_action) { out += "    rule.disable_action = true;\n"; }
+    if (!rule.error_message.empty()) {
+      out += "    rule.error_message = " +
+             cpp_string_literal(rule.error_message) + ";\n";
+    }
+    if (rule.no_ast_opt) { out += "    rule.no_ast_opt = true;\n"; }
+    if (rule.no_packrat) { out += "    rule.no_packrat = true;\n"; }
+    out += "  }\n";
+  }
+
+  out += "\n  for (auto &[_, rule] : g) {\n";
+  out += "    LinkReferences vis(g, rule.params);\n";
+  out += "    rule.accept(vis);\n";
+  out += "  }\n";
+
+  const auto &start_rule = grammar.at(start);
+  std::string start_out;
+  auto start_ope_to_cpp = [&](const std::shared_ptr<Ope> &ope,
+                              const char *field) {
+    if (!ope) { return true; }
+    std::string code;
+    if (!ope_to_cpp(*ope, code)) { return false; }
+    start_out += "    rule." + std::string(field) + " = " + code + ";\n";
+    start_out += "    {\n";
+    start_out += "      std::vector<std::string> params;\n";
+    start_out += "      LinkReferences vis(g, params);\n";
+    start_out += "      rule." + std::string(field) + "->accept(vis);\n";
+    start_out += "    }\n";
+    return true;
+  };
+  if (!start_ope_to_cpp(start_rule.whitespaceOpe, "whitespaceOpe") ||
+      !start_ope_to_cpp(start_rule.wordOpe, "wordOpe")) {
+    return std::string();
+  }
+  if (start_rule.enablePackratParsing) {
+    start_out += "    rule.enablePackratParsing = true;\n";
+  }
+  if (!start_rule.eoi_check) { start_out += "    rule.eoi_check = false;\n"; }
+  if (!start_out.empty()) {
+    out += "\n  {\n";
+    out += "    auto &rule = g[" + cpp_string_literal(start) + "];\n";
+    out += start_out;
+    out += "  }\n";
+  }
+
+  out += "\n  return parser.load_grammar(grammar, " +
+         cpp_string_literal(start) + ", " +
+         (enablePackratParsing ? "true" : "false") + ");\n";
+  out += "}\n";
+  return out;
+}
+
+/*-----------------------------------------------------------------------------
+ *  Compiled grammar
+ *---------------------------------------------------------------------------*/
+
+// A compiled grammar starts with the magic and the format version. Numbers
+// are written as LEB128 varints, and strings as a length and the bytes.
+constexpr const char compiled_grammar_magic[] = "PEGC";
+constexpr uint8_t compiled_grammar_version = 1;
+
+enum class CompiledOpe : uint8_t {
+  Sequence,
+  PrioritizedChoice,
+  ChoiceForLabel,
+  Repetition,
+  AndPredicate,
+  NotPredicate,
+  Dictionary,
+  LiteralString,
+  CharacterClass,
+  Character,
+  AnyCharacter,
+  CaptureScope,
+  Capture,
+  TokenBoundary,
+  Ignore,
+  Reference,
+  Whitespace,
+  BackReference,
+  PrecedenceClimbing,
+  Recovery,
+  Cut,
+};
+
+struct GrammarWriter : public Ope::Visitor {
+  GrammarWriter(const Grammar &grammar, std::string &out)
+      : grammar_(grammar), out_(out) {}
+
+  void visit(Sequence &ope) override {
+    list(CompiledOpe::Sequence, ope.opes_);
+  }
+  void visit(PrioritizedChoice &ope) override {
+    list(ope.for_label_ ? CompiledOpe::ChoiceForLabel
+                        : CompiledOpe::PrioritizedChoice,
+         ope.opes_);
+  }
+  void visit(Repetition &ope) override {
+    tag(CompiledOpe::Repetition);
+    number(ope.min_);
+    number(ope.max_);
+    ope.ope_->accept(*this);
+  }
+  void visit(AndPredicate &ope) override {
+    unary(CompiledOpe::AndPredicate, ope.ope_);
+  }
+  void visit(NotPredicate &ope) override {
+    unary(CompiledOpe::NotPredicate, ope.ope_);
+  }
+  void visit(Dictionary &ope) override {
+    tag(CompiledOpe::Dictionary);
+    flag(ope.trie_.ignore_case());
+    number(ope.trie_.items().size());
+    for (const auto &item : ope.trie_.items()) {
+      text(item);
+    }
+  }
+  void visit(LiteralString &ope) override {
+    tag(CompiledOpe::LiteralString);
+    flag(ope.ignore_case_);
+    text(ope.lit_);
+  }
+  void visit(CharacterClass &ope) override {
+    tag(CompiledOpe::CharacterClass);
+    flag(ope.negated_);
+    flag(ope.ignore_case_);
+    number(ope.ranges_.size());
+    for (const auto &[cp1, cp2] : ope.ranges_) {
+      number(cp1);
+      number(cp2);
+    }
+  }
+  void visit(Character &ope) override {
+    tag(CompiledOpe::Character);
+    out_ += ope.ch_;
+  }
+  void visit(AnyCharacter & /*ope*/) override {
+    tag(CompiledOpe::AnyCharacter);
+  }
+  void visit(CaptureScope &ope) override {
+    unary(CompiledOpe::CaptureScope, ope.ope_);
+  }
+  void visit(Capture &ope) override {
+    // A user provided match action can't be written out.
+    if (ope.name_.empty()) { ret = false; }
+    tag(CompiledOpe::Capture);
+    text(ope.name_);
+    ope.ope_->accept(*this);
+  }
+  void visit(TokenBoundary &ope) override {
+    unary(CompiledOpe::TokenBoundary, ope.ope_);
+  }
+  void visit(Ignore &ope) override { unary(CompiledOpe::Ignore, ope.ope_); }
+  void visit(User & /*ope*/) override { ret = false; }
+  void visit(WeakHolder &ope) override { ope.weak_.lock()->accept(*this); }
+  void visit(Holder &ope) override {
+    // A definition used as an operator works as a reference to it.
+    if (!grammar_.count(ope.outer_->name)) { ret = false; }
+    tag(CompiledOpe::Reference);
+    text(ope.outer_->name);
+    flag(false);
+    number(0);
+  }
+  void visit(Reference &ope) override {
+    tag(CompiledOpe::Reference);
+    text(ope.name_);
+    flag(ope.is_macro_);
+    number(ope.args_.size());
+    for (const auto &arg : ope.args_) {
+      arg->accept(*this);
+    }
+  }
+  void visit(Whitespace &ope) override {
+    auto ign = dynamic_cast<Ignore *>(ope.ope_.get());
+    if (!ign) {
+      ret = false;
+      return;
+    }
+    unary(CompiledOpe::Whitespace, ign->ope_);
+  }
+  void visit(BackReference &ope) override {
+    tag(CompiledOpe::BackReference);
+    text(ope.name_);
+  }
+  void visit(PrecedenceClimbing &ope) override {
+    tag(CompiledOpe::PrecedenceClimbing);
+    ope.atom_->accept(*this);
+    ope.binop_->accept(*this);
+    number(ope.tokens_.size());
+    for (size_t i = 0; i < ope.tokens_.size(); i++) {
+      text(ope.tokens_[i]);
+      number(ope.levels_[i].first);
+      out_ += ope.levels_[i].second;
+    }
+  }
+  void visit(Recovery &ope) override {
+    unary(CompiledOpe::Recovery, ope.ope_);
+  }
+  void visit(Cut & /*ope*/) override { tag(CompiledOpe::Cut); }
+
+  void number(uint64_t n) {
+    do {
+      auto b = static_cast<uint8_t>(n & 0x7f);
+      n >>= 7;
+      out_ += static_cast<char>(n ? (b | 0x80) : b);
+    } while (n);
+  }
+
+  void text(std::string_view sv) {
+    number(sv.size());
+    out_ += sv;
+  }
+
+  void flag(bool b) { out_ += static_cast<char>(b ? 1 : 0); }
+
+  bool ret = true;
+
+private:
+  void tag(CompiledOpe t) { out_ += static_cast<char>(t); }
+
+  void unary(CompiledOpe t, const std::shared_ptr<Ope> &ope) {
+    tag(t);
+    ope->accept(*this);
+  }
+
+  void list(CompiledOpe t, const std::vector<std::shared_ptr<Ope>> &opes) {
+    tag(t);
+    number(opes.size());
+    for (const auto &ope : opes) {
+      ope->accept(*this);
+    }
+  }
+
+  const Grammar &grammar_;
+  std::string &out_;
+};
+
+class GrammarReader {
+public:
+  GrammarReader(const char *s, size_t n, Grammar &grammar)
+      : p_(s), end_(s + n), grammar_(grammar) {}
+
+  bool number(uint64_t &n) {
+    n = 0;
+    for (size_t shift = 0; p_ < end_ && shift < 64; shift += 7) {
+      auto b = static_cast<uint8_t>(*p_++);
+      n |= static_cast<uint64_t>(b & 0x7f) << shift;
+      if (!(b & 0x80)) { return true; }
+    }
+    return false;
+  }
+
+  bool size(size_t &n) {
+    uint64_t v;
+    if (!number(v) || v > static_cast<uint64_t>(end_ - p_)) {
+      return false;
+    }
+    n = static_cast<size_t>(v);
+    return true;
+  }
+
+  bool text(std::string &str) {
+    size_t n;
+    if (!size(n) || n > static_cast<size_t>(end_ - p_)) { return false; }
+    str.assign(p_, n);
+    p_ += n;
+    return true;
+  }
+
+  bool byte(uint8_t &b) {
+    if (p_ == end_) { return false; }
+    b = static_cast<uint8_t>(*p_++);
+    return true;
+  }
+
+  bool flag(bool &f) {
+    uint8_t b;
+    if (!byte(b) || b > 1) { return false; }
+    f = b;
+    return true;
+  }
+
+  bool eof() const { return p_ == end_; }
+
+  static constexpr size_t max_depth = 1024;
+
+  // A null pointer is returned for a broken input, or one nested deeper than
+  // `max_depth`, so that a crafted input can't overflow the stack.
+  std::shared_ptr<Ope> ope(const Definition &rule) {
+    uint8_t t;
+    if (depth_ == max_depth || !byte(t)) { return nullptr; }
+    depth_++;
+    auto se = scope_exit([&]() { depth_--; });
+
+    switch (static_cast<CompiledOpe>(t)) {
+    case CompiledOpe::Sequence: {
+      std::vector<std::shared_ptr<Ope>> opes;
+      if (!list(rule, opes)) { return nullptr; }
+      return std::make_shared<Sequence>(std::move(opes));
+    }
+    case CompiledOpe::PrioritizedChoice:
+    case CompiledOpe::ChoiceForLabel: {
+      std::vector<std::shared_ptr<Ope>> opes;
+      if (!list(rule, opes)) { return nullptr; }
+      auto ope = std::make_shared<PrioritizedChoice>(std::move(opes));
+      ope->for_label_ =
+          static_cast<CompiledOpe>(t) == CompiledOpe::ChoiceForLabel;
+      return ope;
+    }
+    case CompiledOpe::Repetition: {
+      uint64_t min, max;
+      if (!number(min) || !number(max)) { return nullptr; }
+      auto ope = this->ope(rule);
+      if (!ope) { return nullptr; }
+      return rep(ope, static_cast<size_t>(min), static_cast<size_t>(max));
+    }
+    case CompiledOpe::AndPredicate: return unary(rule, apd);
+    case CompiledOpe::NotPredicate: return unary(rule, npd);
+    case CompiledOpe::Dictionary: {
+      bool ignore_case;
+      size_t n;
+      if (!flag(ignore_case) || !size(n)) { return nullptr; }
+      std::vector<std::string> items(n);
+      for (auto &item : items) {
+        if (!text(item)) { return nullptr; }
+      }
+      return dic(items, ignore_case);
+    }
+    case CompiledOpe::LiteralString: {
+      bool ignore_case;
+      std::string lit;
+      if (!flag(ignore_case) || !text(lit)) { return nullptr; }
+      return std::make_shared<LiteralString>(std::move(lit), ignore_case);
+    }
+    case CompiledOpe::CharacterClass: {
+      bool negated, ignore_case;
+      size_t n;
+      if (!flag(negated) || !flag(ignore_case) || !size(n) || !n) {
+        return nullptr;
+      }
+      std::vector<std::pair<char32_t, char32_t>> ranges(n);
+      for (auto &[cp1, cp2] : ranges) {
+        uint64_t v1, v2;
+        if (!number(v1) || !number(v2)) { return nullptr; }
+        cp1 = static_cast<char32_t>(v1);
+        cp2 = static_cast<char32_t>(v2);
+      }
+      return std::make_shared<CharacterClass>(ranges, negated, ignore_case);
+    }
+    case CompiledOpe::Character: {
+      uint8_t ch;
+      if (!byte(ch)) { return nullptr; }
+      return chr(static_cast<char>(ch));
+    }
+    case CompiledOpe::AnyCharacter: return dot();
+    case CompiledOpe::CaptureScope: return unary(rule, csc);
+    case CompiledOpe::Capture: {
+      // The name is shared with the match action, as `Capture` only keeps a
+      // view of it.
+      auto name = std::make_shared<std::string>();
+      if (!text(*name)) { return nullptr; }
+      auto ope = this->ope(rule);
+      if (!ope) { return nullptr; }
+      return std::make_shared<Capture>(
+          ope,
+          [name](const char *a_s, size_t a_n, Context &c) {
+            c.set_capture_value(*name, std::string_view(a_s, a_n));
+          },
+          *name);
+    }
+    case CompiledOpe::TokenBoundary: return unary(rule, tok);
+    case CompiledOpe::Ignore: return unary(rule, ign);
+    case CompiledOpe::Reference: {
+      std::string name;
+      bool is_macro;
+      std::vector<std::shared_ptr<Ope>> args;
+      if (!text(name) || !flag(is_macro) || !list(rule, args)) {
+        return nullptr;
+      }
+      return ref(grammar_, name, "", is_macro, args);
+    }
+    case CompiledOpe::Whitespace: return unary(rule, wsp);
+    case CompiledOpe::BackReference: {
+      std::string name;
+      if (!text(name)) { return nullptr; }
+      return bkr(std::move(name));
+    }
+    case CompiledOpe::PrecedenceClimbing: {
+      auto atom = ope(rule);
+      auto binop = atom ? ope(rule) : nullptr;
+      size_t n;
+      if (!dynamic_cast<Reference *>(binop.get()) || !size(n)) {
+        return nullptr;
+      }
+      // The views in `info` are only used while the operator is built.
+      std::vector<std::string> tokens(n);
+      PrecedenceClimbing::BinOpeInfo info;
+      for (auto &token : tokens) {
+        uint64_t level;
+        uint8_t assoc;
+        if (!text(token) || !number(level) || !byte(assoc)) {
+          return nullptr;
+        }
+        info[token] = std::pair(static_cast<size_t>(level),
+                                static_cast<char>(assoc));
+      }
+      return pre(atom, binop, info, rule);
+    }
+    case CompiledOpe::Recovery: return unary(rule, rec);
+    case CompiledOpe::Cut: return cut();
+    }
+    return nullptr;
+  }
+
+private:
+  std::shared_ptr<Ope>
+  unary(const Definition &rule,
+        std::shared_ptr<Ope> (*fn)(const std::shared_ptr<Ope> &)) {
+    auto ope = this->ope(rule);
+    return ope ? fn(ope) : nullptr;
+  }
+
+  bool list(const Definition &rule, std::vector<std::shared_ptr<Ope>> &opes) {
+    size_t n;
+    if (!size(n)) { return false; }
+    for (size_t i = 0; i < n; i++) {
+      auto ope = this->ope(rule);
+      if (!ope) { return false; }
+      opes.push_back(ope);
+    }
+    return true;
+  }
+
+  const char *p_;
+  const char *end_;
+  Grammar &grammar_;
+  size_t depth_ = 0;
+};
+
+// Write a grammar in the compiled form, which `load_compiled_grammar` reads
+// back without parsing the grammar text or checking it again. An empty
+// string is returned when the grammar can't be written out, as in
+// `generate_cpp`.
+inline std::string compile_grammar(const Grammar &grammar,
+                                   const std::string &start,
+                                   bool enablePackratParsing) {
+  std::string out(compiled_grammar_magic);
+  GrammarWriter w(grammar, out);
+  out += static_cast<char>(compiled_grammar_version);
+  w.text(start);
+  w.flag(enablePackratParsing);
+
+  // Sort definitions by name for a stable output.
+  std::vector<std::string> rule_names;
+  for (const auto &[rule_name, _] : grammar) {
+    rule_names.push_back(rule_name);
+  }
+  std::sort(rule_names.begin(), rule_names.end());
+
+  w.number(rule_names.size());
+  for (const auto &rule_name : rule_names) {
+    const auto &rule = grammar.at(rule_name);
+    w.text(rule_name);
+    w.flag(rule.ignoreSemanticValue);
+    w.flag(rule.is_macro);
+    w.number(rule.params.size());
+    for (const auto &param : rule.params) {
+      w.text(param);
+    }
+    w.flag(rule.disable_action);
+    w.text(rule.error_message);
+    w.flag(rule.no_ast_opt);
+    w.flag(rule.no_packrat);
+    rule.get_core_operator()->accept(w);
+  }
+
+  const auto &start_rule = grammar.at(start);
+  for (const auto &ope : {start_rule.whitespaceOpe, start_rule.wordOpe}) {
+    w.flag(ope != nullptr);
+    if (ope) { ope->accept(w); }
+  }
+  w.flag(start_rule.enablePackratParsing);
+  w.flag(start_rule.eoi_check);
+
+  if (!w.ret) { return std::string(); }
+  return out;
+}
+
+// A null pointer is returned for data which isn't a compiled grammar of
+// this version.
+inline std::shared_ptr<Grammar>
+load_compiled_grammar(const char *s, size_t n, std::string &start,
+                      bool &enablePackratParsing) {
+  auto magic_len = sizeof(compiled_grammar_magic) - 1;
+  if (n <= magic_len ||
+      std::string_view(s, magic_len) != compiled_grammar_magic ||
+      static_cast<uint8_t>(s[magic_len]) != compiled_grammar_version) {
+    return nullptr;
+  }
+
+  auto grammar = std::make_shared<Grammar>();
+  auto &g = *grammar;
+  GrammarReader r(s + magic_len + 1, n - magic_len - 1, g);
+
+  size_t rule_count;
+  if (!r.text(start) || !r.flag(enablePackratParsing) ||
+      !r.size(rule_count)) {
+    return nullptr;
+  }
+
+  for (size_t i = 0; i < rule_count; i++) {
+    std::string rule_name;
+    if (!r.text(rule_name) || g.count(rule_name)) { return nullptr; }
+    auto &rule = g[rule_name];
+    rule.name = rule_name;
+
+    size_t param_count;
+    if (!r.flag(rule.ignoreSemanticValue) || !r.flag(rule.is_macro) ||
+        !r.size(param_count)) {
+      return nullptr;
+    }
+    rule.params.resize(param_count);
+    for (auto &param : rule.params) {
+      if (!r.text(param)) { return nullptr; }
+    }
+    if (!r.flag(rule.disable_action) || !r.text(rule.error_message) ||
+        !r.flag(rule.no_ast_opt) || !r.flag(rule.no_packrat)) {
+      return nullptr;
+    }
+
+    auto ope = r.ope(rule);
+    if (!ope) { return nullptr; }
+    rule <= ope;
+  }
+
+  // A reference which is neither a rule nor a parameter would be parsed as
+  // an argument that isn't there, so these are checked as in `load_grammar`.
+  for (auto &[_, rule] : g) {
+    ReferenceChecker vis(g, rule.params);
+    rule.accept(vis);
+    if (!vis.error_s.empty()) { return nullptr; }
+  }
+
+  for (auto &[_, rule] : g) {
+    LinkReferences vis(g, rule.params);
+    rule.accept(vis);
+  }
+
+  if (!g.count(start)) { return nullptr; }
+  auto &start_rule = g[start];
+  for (auto field : {&start_rule.whitespaceOpe, &start_rule.wordOpe}) {
+    bool present;
+    if (!r.flag(present)) { return nullptr; }
+    if (present) {
+      *field = r.ope(start_rule);
+      if (!*field) { return nullptr; }
+      std::vector<std::string> params;
+      ReferenceChecker checker(g, params);
+      (*field)->accept(checker);
+      if (!checker.error_s.empty()) { return nullptr; }
+      LinkReferences vis(g, params);
+      (*field)->accept(vis);
+    }
+  }
+  if (!r.flag(start_rule.enablePackratParsing) ||
+      !r.flag(start_rule.eoi_check) || !r.eof()) {
+    return nullptr;
+  }
+
+  InstantiateMacros::instantiate(g);
+  return grammar;
+}
+
 /*-----------------------------------------------------------------------------
  *  parser
  *---------------------------------------------------------------------------*/
 
+// An edit which replaced `length` bytes at `offset` with `new_length` bytes
+struct TextEdit {
+  size_t offset = 0;
+  size_t length = 0;
+  size_t new_length = 0;
+};
+
 class parser {
 public:
   parser() = default;
@@ -4488,6 +7517,7 @@ public:
   bool load_grammar(const char *s, size_t n, const Rules &rules) {
     grammar_ = ParserGenerator::parse(s, n, rules, start_,
                                       enablePackratParsing_, log_);
+    assign_rule_ids();
     return grammar_ != nullptr;
   }
 
@@ -4503,6 +7533,37 @@ public:
     return load_grammar(sv.data(), sv.size());
   }
 
+  // Use a grammar which is already built, e.g. by the code `generate_cpp`
+  // writes out.
+  bool load_grammar(std::shared_ptr<Grammar> grammar, const std::string &start,
+                    bool enablePackratParsing = true) {
+    if (grammar == nullptr || !grammar->count(start)) {
+      grammar_ = nullptr;
+      return false;
+    }
+    grammar_ = grammar;
+    start_ = start;
+    enablePackratParsing_ = enablePackratParsing;
+    InstantiateMacros::instantiate(*grammar_);
+    assign_rule_ids();
+    return true;
+  }
+
+  // Use a grammar saved by `save_compiled`. The grammar text isn't parsed,
+  // and the grammar isn't checked again.
+  bool load_compiled(const char *s, size_t n) {
+    grammar_ = load_compiled_grammar(s, n, start_, enablePackratParsing_);
+    assign_rule_ids();
+    if (grammar_ == nullptr && log_) {
+      log_(1, 1, "invalid compiled grammar.", "");
+    }
+    return grammar_ != nullptr;
+  }
+
+  bool load_compiled(std::string_view sv) {
+    return load_compiled(sv.data(), sv.size());
+  }
+
   bool parse_n(const char *s, size_t n, const char *path = nullptr) const {
     if (grammar_ != nullptr) {
       const auto &rule = (*grammar_)[start_];
@@ -4589,12 +7650,329 @@ public:
   }
 #endif
 
+  // Parse the inputs on `thread_count` threads (0 means the number of
+  // hardware threads) and return the results in the order of the inputs. The
+  // logger is called after all the parses, for one input after another.
+  std::vector<bool> parse_batch(const std::vector<std::string_view> &inputs,
+                                size_t thread_count = 0) const {
+    return parse_batch_core(
+        inputs, thread_count,
+        [](size_t, const Definition &rule, std::string_view sv, Log log) {
+          return rule.parse(sv.data(), sv.size(), nullptr, log);
+        });
+  }
+
+  template <typename T>
+  std::vector<bool> parse_batch(const std::vector<std::string_view> &inputs,
+                                std::vector<T> &vals,
+                                size_t thread_count = 0) const {
+    // The threads write their own elements, which `std::vector<bool>` would
+    // pack into shared words, so the values are moved to `vals` afterwards.
+    auto results = std::make_unique<T[]>(inputs.size());
+    auto rets = parse_batch_core(
+        inputs, thread_count,
+        [&](size_t i, const Definition &rule, std::string_view sv, Log log) {
+          return rule.parse_and_get_value(sv.data(), sv.size(), results[i],
+                                          nullptr, log);
+        });
+    vals.clear();
+    vals.reserve(inputs.size());
+    for (size_t i = 0; i < inputs.size(); i++) {
+      vals.push_back(std::move(results[i]));
+    }
+    return rets;
+  }
+
+  // Parse the input as a sequence of `item_rule` and return the values of
+  // the items in order. The input is split into chunks right after
+  // occurrences of `delimiter`, and the chunks are parsed in parallel. Each
+  // chunk must start where the items of the chunk before end, which rules
+  // out a delimiter inside an item. If that doesn't hold, or if a chunk
+  // can't be parsed, the whole input is parsed again on the calling thread,
+  // which also reports the errors. The start rule supplies %whitespace and
+  // %word but isn't called, and packrat parsing isn't used.
+  template <typename T>
+  bool parse_parallel(std::string_view sv, const char *item_rule,
+                      std::string_view delimiter, std::vector<T> &items,
+                      size_t thread_count = 0,
+                      const char *path = nullptr) const {
+    items.clear();
+    if (grammar_ == nullptr || !grammar_->count(item_rule)) { return false; }
+
+    freeze();
+    std::shared_ptr<Ope> ope = (*grammar_)[item_rule];
+
+    if (!thread_count) { thread_count = std::thread::hardware_concurrency(); }
+    auto chunk_count = (std::max)(thread_count, size_t(1)) * 4;
+
+    std::vector<size_t> bounds{0};
+    if (!delimiter.empty()) {
+      for (size_t k = 1; k < chunk_count; k++) {
+        auto target = (std::max)(sv.size() / chunk_count * k, bounds.back());
+        auto pos = sv.find(delimiter, target);
+        if (pos == std::string_view::npos) { break; }
+        pos += delimiter.size();
+        if (pos >= sv.size()) { break; }
+        if (pos > bounds.back()) { bounds.push_back(pos); }
+      }
+    }
+    bounds.push_back(sv.size());
+
+    auto count = bounds.size() - 1;
+    std::vector<std::vector<T>> chunk_items(count);
+    std::vector<char> oks(count);
+    std::vector<size_t> firsts(count);
+    std::vector<size_t> lasts(count);
+
+    // The chunks share one index of the lines.
+    auto line_index = std::make_shared<LineIndex>(path, sv.data(), sv.size());
+    run_in_parallel(count, thread_count, [&](size_t i) {
+      oks[i] = parse_items(ope, sv.data(), sv.size(), bounds[i], bounds[i + 1],
+                           path, nullptr, chunk_items[i], firsts[i], lasts[i],
+                           line_index);
+    });
+
+    // A chunk which doesn't start where the one before ends started inside
+    // an item.
+    auto synced =
+        std::all_of(oks.begin(), oks.end(), [](char ok) { return ok; });
+    for (size_t i = 1; synced && i < count; i++) {
+      synced = lasts[i - 1] == firsts[i];
+    }
+    if (synced) {
+      for (auto &vals : chunk_items) {
+        std::move(vals.begin(), vals.end(), std::back_inserter(items));
+      }
+      return true;
+    }
+
+    size_t first;
+    size_t last;
+    return parse_items(ope, sv.data(), sv.size(), 0, sv.size(), path, log_,
+                       items, first, last);
+  }
+
+  // Parse the file at `path` without copying it into memory. The file is
+  // mapped while it's parsed, and if the value is an AST, every node keeps
+  // the mapping alive, so the tokens stay valid. Returns false if the file
+  // can't be opened.
+  bool parse_file(const char *path) const {
+    MappedFile file(path);
+    return file.is_open() && parse_n(file.data(), file.size(), path);
+  }
+
+  template <typename T> bool parse_file(const char *path, T &val) const {
+    auto file = std::make_shared<MappedFile>(path);
+    if (!file->is_open()) { return false; }
+    auto ret = parse_n(file->data(), file->size(), val, path);
+    keep_source(val, file);
+    return ret;
+  }
+
+  // Update `items`, the ASTs of the `item_rule` items of the old text, after
+  // `edit` turned it into `sv`. Only the items from the one the edit touches
+  // up to the first one which starts at the same text as before are parsed
+  // again. The other items are kept. The ones after the edit are moved to the
+  // new positions, and their tokens to `sv`, while the ones before it are
+  // only visited when `sv` isn't at `old_s`, the address of the old text,
+  // which isn't read. This
+  // assumes that an item doesn't look at the text after its end. If the new
+  // items can't be parsed, `items` is left as it is.
+  template <typename Annotation>
+  bool reparse_items(const char *old_s, std::string_view sv,
+                     const char *item_rule, const TextEdit &edit,
+                     std::vector<std::shared_ptr<AstBase<Annotation>>> &items,
+                     const char *path = nullptr) const {
+    using AstPtr = std::shared_ptr<AstBase<Annotation>>;
+    if (grammar_ == nullptr || !grammar_->count(item_rule)) { return false; }
+
+    freeze();
+    std::shared_ptr<Ope> ope = (*grammar_)[item_rule];
+    const auto &start = (*grammar_)[start_];
+
+    auto s = sv.data();
+    auto n = sv.size();
+    auto delta = static_cast<std::ptrdiff_t>(edit.new_length) -
+                 static_cast<std::ptrdiff_t>(edit.length);
+
+    size_t k = 0;
+    while (k < items.size() &&
+           items[k]->position + items[k]->length < edit.offset) {
+      k++;
+    }
+    auto i = k ? items[k - 1]->position + items[k - 1]->length : 0;
+
+    Context c(path, s, n, 0, start.whitespaceOpe, start.wordOpe, false, 0, 0,
+              nullptr, nullptr, nullptr, false, log_);
+    std::any dt;
+
+    // The item before doesn't include the whitespace after it.
+    if (start.whitespaceOpe) {
+      SemanticValues dummy_vs;
+      auto len = start.whitespaceOpe->parse(s + i, n - i, dummy_vs, c, dt);
+      if (success(len)) { i += len; }
+    }
+
+    std::vector<AstPtr> vals;
+    auto j = k;
+    auto synced = false;
+    while (i < n) {
+      SemanticValues vs;
+      auto len = ope->parse(s + i, n - i, vs, c, dt);
+      if (fail(len) || !len) { break; }
+      for (const auto &v : vs) {
+        vals.push_back(std::any_cast<AstPtr>(v));
+        keep_ast_arena(vals.back(), c.ast_arena);
+      }
+      i += len;
+
+      if (i >= edit.offset + edit.new_length) {
+        auto old_i =
+            static_cast<size_t>(static_cast<std::ptrdiff_t>(i) - delta);
+        while (j < items.size() && items[j]->position < old_i) {
+          j++;
+        }
+        if (j < items.size() && items[j]->position == old_i) {
+          synced = true;
+          break;
+        }
+      }
+    }
+
+    if ((!synced && i < n) || c.recovered) {
+      if (log_ && !c.recovered) {
+        if (c.error_info.error_pos - c.s < s + i - c.s) {
+          c.error_info.message_pos = s + i;
+          c.error_info.message = "expected end of input";
+        }
+        c.error_info.output_log(log_, s, n);
+      }
+      return false;
+    }
+
+    // The items before the edit keep their positions and lines, so they are
+    // only visited when the text moved. The ones after it find their lines
+    // in the new text.
+    auto old_addr = reinterpret_cast<std::uintptr_t>(old_s);
+    if (old_addr != reinterpret_cast<std::uintptr_t>(s)) {
+      for (size_t l = 0; l < k; l++) {
+        move_ast(items[l], old_addr, s, 0, nullptr);
+      }
+    }
+    if (synced) {
+      std::shared_ptr<const LineIndex> line_index = c.line_index();
+      for (auto l = j; l < items.size(); l++) {
+        move_ast(items[l], old_addr, s, delta, line_index);
+      }
+      vals.insert(vals.end(), items.begin() + static_cast<std::ptrdiff_t>(j),
+                  items.end());
+    }
+    items.erase(items.begin() + static_cast<std::ptrdiff_t>(k), items.end());
+    std::move(vals.begin(), vals.end(), std::back_inserter(items));
+    return true;
+  }
+
+  // Read `is` in blocks of `block_size` bytes, parse it as a sequence of
+  // `item_rule` and call `fn` with the value of each item. The text read so
+  // far is parsed up to the end of the last `delimiter` in it. The items done
+  // are handed over and their text is discarded, so the values must not keep
+  // views into the input. An item which runs into the last delimiter is
+  // tried again with more text, and one which fails before it is an error.
+  template <typename T, typename F>
+  bool parse_stream(std::istream &is, const char *item_rule,
+                    std::string_view delimiter, F fn,
+                    size_t block_size = 64 * 1024,
+                    const char *path = nullptr) const {
+    if (grammar_ == nullptr || !grammar_->count(item_rule)) { return false; }
+
+    freeze();
+    std::shared_ptr<Ope> ope = (*grammar_)[item_rule];
+
+    size_t line_offset = 0;
+    size_t col_offset = 0;
+    size_t byte_col_offset = 0;
+    Log log;
+    if (log_) {
+      log = [&](size_t ln, size_t col, const std::string &msg,
+                const std::string &rule) {
+        if (ln == 1) { col += col_offset; }
+        log_(ln + line_offset, col, msg, rule);
+      };
+    }
+
+    std::string buf;
+    size_t tried = 0;
+    auto eof = false;
+    while (true) {
+      auto end = buf.size();
+      if (!eof) {
+        auto pos = delimiter.empty() ? std::string::npos : buf.rfind(delimiter);
+        end = pos == std::string::npos ? 0 : pos + delimiter.size();
+      }
+
+      if (end > tried || (eof && end)) {
+        std::vector<T> vals;
+        auto line_index = std::make_shared<LineIndex>(path, buf.data(), end);
+        line_index->line_offset = line_offset;
+        line_index->column_offset =
+            static_cast<std::ptrdiff_t>(byte_col_offset);
+        auto error = false;
+        auto len = parse_stream_items(ope, buf.data(), end, eof, path, log,
+                                      vals, line_index, error);
+        // The lines are found before the text is discarded.
+        line_index->build();
+        for (auto &val : vals) {
+          fn(val);
+        }
+        if (error) { return false; }
+
+        for (size_t i = 0; i < len; i++) {
+          if (buf[i] == '\n') {
+            line_offset++;
+            col_offset = 0;
+            byte_col_offset = 0;
+          } else {
+            if ((buf[i] & 0xc0) != 0x80) { col_offset++; }
+            byte_col_offset++;
+          }
+        }
+        buf.erase(0, len);
+        tried = end - len;
+        if (len) { continue; }
+      } else if (eof) {
+        return true;
+      }
+
+      auto size = buf.size();
+      buf.resize(size + block_size);
+      is.read(&buf[size], static_cast<std::streamsize>(block_size));
+      auto count = static_cast<size_t>(is.gcount());
+      buf.resize(size + count);
+      if (!count) { eof = true; }
+    }
+  }
+
   Definition &operator[](const char *s) { return (*grammar_)[s]; }
 
   const Definition &operator[](const char *s) const { return (*grammar_)[s]; }
 
   const Grammar &get_grammar() const { return *grammar_; }
 
+  std::string generate_cpp(const std::string &name) const {
+    if (grammar_ != nullptr) {
+      return peg::generate_cpp(*grammar_, start_, enablePackratParsing_, name);
+    }
+    return std::string();
+  }
+
+  // The grammar in the compiled form for `load_compiled`
+  std::string save_compiled() const {
+    if (grammar_ != nullptr) {
+      return compile_grammar(*grammar_, start_, enablePackratParsing_);
+    }
+    return std::string();
+  }
+
   void disable_eoi_check() {
     if (grammar_ != nullptr) {
       auto &rule = (*grammar_)[start_];
@@ -4609,6 +7987,103 @@ public:
     }
   }
 
+  // Report the patterns in the rules which make parsing slower, in the order
+  // of the definitions, at their positions in the grammar text.
+  void report_performance(Log log) const {
+    if (grammar_ == nullptr || !log) { return; }
+
+    std::vector<const Definition *> rules;
+    for (const auto &[name, rule] : *grammar_) {
+      rules.push_back(&rule);
+    }
+    std::sort(rules.begin(), rules.end(), [](auto a, auto b) {
+      return a->line_ < b->line_;
+    });
+
+    const auto &start = (*grammar_)[start_];
+    for (auto rule : rules) {
+      PerformanceLint vis(start.whitespaceOpe);
+      const_cast<Definition *>(rule)->accept(vis);
+      for (const auto &msg : vis.messages) {
+        log(rule->line_.first, rule->line_.second,
+            "'" + rule->name + "': " + msg, rule->name);
+      }
+    }
+  }
+
+  // Collect per rule counters and timings into the returned profile, which
+  // is shared by the following parses. Disabled with `false`.
+  std::shared_ptr<Profile> enable_profile(bool enable = true) {
+    if (grammar_ == nullptr) { return nullptr; }
+    auto &rule = (*grammar_)[start_];
+    rule.profile = enable ? std::make_shared<Profile>() : nullptr;
+    return rule.profile;
+  }
+
+  // Finish the lazy initialization of the grammar. Call this after setting up
+  // the parser and before sharing it among threads.
+  void freeze() const {
+    if (grammar_ != nullptr) { (*grammar_)[start_].freeze(); }
+  }
+
+  // Lower the rules to instructions, which parse them when there is no
+  // logger nor tracer. Call this after setting up the grammar, and it returns
+  // the number of the lowered rules. The other rules keep the operators.
+  size_t lower_grammar() {
+    if (grammar_ == nullptr) { return 0; }
+    return Program::lower(*grammar_, start_);
+  }
+
+  // Parse without error bookkeeping first, and parse again with a logger
+  // only when the first pass fails. Semantic actions run in both passes.
+  void enable_two_pass_error_reporting() {
+    if (grammar_ != nullptr) {
+      auto &rule = (*grammar_)[start_];
+      rule.two_pass_error_reporting = true;
+    }
+  }
+
+  // Limit the number of memoized results kept by packrat parsing. (0 means
+  // no limit)
+  void set_packrat_cache_limit(size_t max_entries) {
+    if (grammar_ != nullptr) {
+      auto &rule = (*grammar_)[start_];
+      rule.packrat_cache_limit = max_entries;
+    }
+  }
+
+  // Memoize results only for the last `positions` positions behind the
+  // furthest position. (0 means the whole input)
+  void set_packrat_window(size_t positions) {
+    if (grammar_ != nullptr) {
+      auto &rule = (*grammar_)[start_];
+      rule.packrat_window = positions;
+    }
+  }
+
+  // Parse a sample input and memoize only the rules which reuse memoized
+  // results often enough. Semantic actions are invoked as in `parse`.
+  bool train_packrat(const char *s, size_t n, std::any &dt,
+                     double min_hit_ratio = 0.1,
+                     const char *path = nullptr) {
+    if (grammar_ != nullptr && enablePackratParsing_) {
+      auto &rule = (*grammar_)[start_];
+      return rule.train_packrat(s, n, dt, min_hit_ratio, path).ret;
+    }
+    return false;
+  }
+
+  bool train_packrat(const char *s, size_t n, double min_hit_ratio = 0.1,
+                     const char *path = nullptr) {
+    std::any dt;
+    return train_packrat(s, n, dt, min_hit_ratio, path);
+  }
+
+  bool train_packrat(std::string_view sv, double min_hit_ratio = 0.1,
+                     const char *path = nullptr) {
+    return train_packrat(sv.data(), sv.size(), min_hit_ratio, path);
+  }
+
   void enable_trace(TracerEnter tracer_enter, TracerLeave tracer_leave) {
     if (grammar_ != nullptr) {
       auto &rule = (*grammar_)[start_];
@@ -4636,9 +8111,22 @@ public:
     }
   }
 
-  template <typename T = Ast> parser &enable_ast() {
+  // With `use_arena`, the AST nodes of a parse are allocated from one arena
+  // which is released with the last node.
+  template <typename T = Ast> parser &enable_ast(bool use_arena = false) {
     for (auto &[_, rule] : *grammar_) {
-      if (!rule.action) { add_ast_action<T>(rule); }
+      if (!rule.action) { add_ast_action<T>(rule, use_arena); }
+    }
+    return *this;
+  }
+
+  // Build the AST which `optimize_ast(ast, opt_mode)` would return directly.
+  template <typename T = Ast>
+  parser &enable_optimized_ast(bool opt_mode = true, bool use_arena = false) {
+    for (auto &[_, rule] : *grammar_) {
+      if (!rule.action) {
+        add_ast_action<T>(rule, use_arena, opt_mode != rule.no_ast_opt);
+      }
     }
     return *this;
   }
@@ -4659,11 +8147,263 @@ public:
   }
 
 private:
+  void assign_rule_ids() {
+    if (grammar_ == nullptr) { return; }
+    std::vector<Definition *> rules;
+    for (auto &[_, rule] : *grammar_) {
+      rules.push_back(&rule);
+    }
+    std::sort(rules.begin(), rules.end(),
+              [](auto a, auto b) { return a->name < b->name; });
+    for (size_t id = 0; id < rules.size(); id++) {
+      rules[id]->rule_id = id;
+      rules[id]->tag = str2tag(rules[id]->name);
+    }
+  }
+
   bool post_process(const char *s, size_t n, Definition::Result &r) const {
     if (log_ && !r.ret) { r.error_info.output_log(log_, s, n); }
     return r.ret && !r.recovered;
   }
 
+  // Move the positions by `delta`, and make the tokens point into `s` and the
+  // lines be found with `line_index`, if it is given. The old text at
+  // `old_addr` may be gone, so the tokens' offsets in it are found as
+  // numbers rather than by subtracting pointers into it.
+  template <typename Annotation>
+  static void move_ast(const std::shared_ptr<AstBase<Annotation>> &ast,
+                       std::uintptr_t old_addr, const char *s,
+                       std::ptrdiff_t delta,
+                       const std::shared_ptr<const LineIndex> &line_index) {
+    ast->position = static_cast<size_t>(
+        static_cast<std::ptrdiff_t>(ast->position) + delta);
+    if (line_index) { ast->line_index = line_index; }
+    if (ast->is_token) {
+      auto offset = static_cast<std::ptrdiff_t>(
+          reinterpret_cast<std::uintptr_t>(ast->token.data()) - old_addr);
+      ast->token = std::string_view(s + offset + delta, ast->token.size());
+    }
+    for (const auto &node : ast->nodes) {
+      move_ast(node, old_addr, s, delta, line_index);
+    }
+  }
+
+  template <typename T>
+  static void keep_source(T &, const std::shared_ptr<const void> &) {}
+
+  template <typename Annotation>
+  static void keep_source(std::shared_ptr<AstBase<Annotation>> &ast,
+                          const std::shared_ptr<const void> &source) {
+    if (!ast) { return; }
+    ast->source = source;
+    for (auto &node : ast->nodes) {
+      keep_source(node, source);
+    }
+  }
+
+  // Call `fn` with 0 to `count - 1` on `thread_count` threads. An exception
+  // thrown by `fn` stops the rest of the calls and is rethrown.
+  template <typename F>
+  static void run_in_parallel(size_t count, size_t thread_count, F fn) {
+    std::atomic<size_t> next{0};
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto work = [&]() {
+      for (auto i = next++; i < count; i = next++) {
+        try {
+          fn(i);
+        } catch (...) {
+          std::lock_guard<std::mutex> guard(error_mutex);
+          if (!error) { error = std::current_exception(); }
+          next = count;
+        }
+      }
+    };
+
+    if (!thread_count) { thread_count = std::thread::hardware_concurrency(); }
+    thread_count = (std::min)(thread_count, count);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; i++) {
+      threads.emplace_back(work);
+    }
+    work();
+    for (auto &th : threads) {
+      th.join();
+    }
+
+    if (error) { std::rethrow_exception(error); }
+  }
+
+  // Parse the items from `beg` until one ends at `end` or after it, and
+  // append their values. The items see the text up to `n`, so that one which
+  // runs over `end` is parsed as a whole. `first` is set to where the first
+  // item starts after the whitespace, and `last` to where the last one ends.
+  template <typename T>
+  bool parse_items(const std::shared_ptr<Ope> &item, const char *s, size_t n,
+                   size_t beg, size_t end, const char *path, Log log,
+                   std::vector<T> &vals, size_t &first, size_t &last,
+                   std::shared_ptr<LineIndex> line_index = nullptr) const {
+    const auto &start = (*grammar_)[start_];
+    Context c(path, s, n, 0, start.whitespaceOpe, start.wordOpe, false, 0, 0,
+              nullptr, nullptr, nullptr, false, log);
+    if (line_index) { c.set_line_index(line_index); }
+
+    std::any dt;
+
+    auto i = beg;
+    if (start.whitespaceOpe) {
+      SemanticValues dummy_vs;
+      auto len = start.whitespaceOpe->parse(s + i, n - i, dummy_vs, c, dt);
+      if (success(len)) { i += len; }
+    }
+    first = i;
+
+    std::vector<T> chunk_vals;
+    while (i < end && !c.recovered) {
+      SemanticValues vs;
+      auto len = item->parse(s + i, n - i, vs, c, dt);
+      if (fail(len) || !len || c.recovered) { break; }
+      for (const auto &v : vs) {
+        chunk_vals.push_back(std::any_cast<T>(v));
+        keep_ast_arena(chunk_vals.back(), c.ast_arena);
+      }
+      i += len;
+    }
+    last = i;
+
+    if (i < end || c.recovered) {
+      if (log && !c.recovered) {
+        if (c.error_info.error_pos - c.s < s + i - c.s) {
+          c.error_info.message_pos = s + i;
+          c.error_info.message = "expected end of input";
+        }
+        c.error_info.output_log(log, s, n);
+      }
+      return false;
+    }
+
+    std::move(chunk_vals.begin(), chunk_vals.end(), std::back_inserter(vals));
+    return true;
+  }
+
+  // Parse the items in the first `n` bytes of `s` as far as they go, and
+  // return the length of them. An item which fails before `n`, where more
+  // text couldn't change the result, or anywhere at the end of the stream is
+  // an error.
+  template <typename T>
+  size_t parse_stream_items(const std::shared_ptr<Ope> &item, const char *s,
+                            size_t n, bool eof, const char *path, Log log,
+                            std::vector<T> &vals,
+                            std::shared_ptr<LineIndex> line_index,
+                            bool &error) const {
+    const auto &start = (*grammar_)[start_];
+    Context c(path, s, n, 0, start.whitespaceOpe, start.wordOpe, false, 0, 0,
+              nullptr, nullptr, nullptr, false, log);
+    c.set_line_index(line_index);
+
+    std::any dt;
+    size_t i = 0;
+    if (start.whitespaceOpe) {
+      SemanticValues dummy_vs;
+      auto len = start.whitespaceOpe->parse(s, n, dummy_vs, c, dt);
+      if (success(len)) { i = len; }
+    }
+
+    while (i < n && !c.recovered) {
+      SemanticValues vs;
+      auto len = item->parse(s + i, n - i, vs, c, dt);
+      if (fail(len) || !len || c.recovered) { break; }
+      for (const auto &v : vs) {
+        vals.push_back(std::any_cast<T>(v));
+        keep_ast_arena(vals.back(), c.ast_arena);
+      }
+      i += len;
+    }
+
+    if (i < n || c.recovered) {
+      if (!eof && !c.recovered &&
+          stream_item_error_pos(item, s + i, n - i, c, path) >= s + n) {
+        return i;
+      }
+      error = true;
+      if (log && !c.recovered) {
+        if (c.error_info.error_pos - c.s < s + i - c.s) {
+          c.error_info.message_pos = s + i;
+          c.error_info.message = "expected end of input";
+        }
+        c.error_info.output_log(log, s, n);
+      }
+    }
+    return i;
+  }
+
+  // The farthest position which the failed item at `s` reached, which tells
+  // an item cut off by the end of the text apart from a syntax error. The
+  // error position is only kept with a logger, which also skips the choice
+  // dispatch and the lowered rules. So without one, only the failed item is
+  // parsed again with a logger which drops the messages.
+  const char *stream_item_error_pos(const std::shared_ptr<Ope> &item,
+                                    const char *s, size_t n, Context &c,
+                                    const char *path) const {
+    if (c.log) { return c.error_info.error_pos; }
+    const auto &start = (*grammar_)[start_];
+    Context track(path, s, n, 0, start.whitespaceOpe, start.wordOpe, false, 0,
+                  0, nullptr, nullptr, nullptr, false,
+                  [](size_t, size_t, const std::string &,
+                     const std::string &) {});
+    SemanticValues vs;
+    std::any dt;
+    item->parse(s, n, vs, track, dt);
+    return track.error_info.error_pos;
+  }
+
+  template <typename F>
+  std::vector<bool> parse_batch_core(const std::vector<std::string_view> &inputs,
+                                     size_t thread_count, F parse) const {
+    std::vector<bool> rets(inputs.size());
+    if (grammar_ == nullptr) { return rets; }
+
+    freeze();
+    const auto &rule = (*grammar_)[start_];
+
+    struct Message {
+      size_t line;
+      size_t col;
+      std::string msg;
+      std::string rule;
+    };
+
+    std::vector<char> oks(inputs.size());
+    std::vector<std::vector<Message>> messages(log_ ? inputs.size() : 0);
+
+    run_in_parallel(inputs.size(), thread_count, [&](size_t i) {
+      Log log;
+      if (log_) {
+        log = [&messages, i](size_t line, size_t col, const std::string &msg,
+                             const std::string &rule) {
+          messages[i].push_back(Message{line, col, msg, rule});
+        };
+      }
+
+      auto sv = inputs[i];
+      auto r = parse(i, rule, sv, log);
+      if (log && !r.ret) { r.error_info.output_log(log, sv.data(), sv.size()); }
+      oks[i] = r.ret && !r.recovered;
+    });
+
+    for (size_t i = 0; i < inputs.size(); i++) {
+      rets[i] = oks[i];
+      if (log_) {
+        for (const auto &m : messages[i]) {
+          log_(m.line, m.col, m.msg, m.rule);
+        }
+      }
+    }
+    return rets;
+  }
+
   std::vector<std::string> get_no_ast_opt_rules() const {
     std::vector<std::string> rules;
     for (auto &[name, rule] : *grammar_) {
@@ -136,7 +136,7 @@ struct SymbolScope {
 
 void throw_runtime_error(const shared_ptr<AstPL0> node, const string& msg) {
   throw runtime_error(
-      format_error_message(node->path, node->line, node->column, msg));
+      format_error_message(node->path(), node->line(), node->column(), msg));
 }
 
 struct SymbolTable {
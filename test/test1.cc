@@ -417,6 +417,124 @@ TEST(GeneralTest, Custom_AST_test) {
   EXPECT_EQ(4, ast->nodes.size());
 }
 
+TEST(GeneralTest, Arena_AST_test) {
+  parser parser(R"(
+        ROOT <- _ TEXT*
+        TEXT <- [a-zA-Z]+ _
+        _ <- [ \t\r\n]*
+    )");
+
+  parser.enable_ast(true);
+  std::shared_ptr<Ast> ast;
+  bool ret = parser.parse("a b c", ast);
+  EXPECT_TRUE(ret);
+  EXPECT_EQ(4, ast->nodes.size());
+  EXPECT_EQ("TEXT", ast->nodes[2]->name);
+  EXPECT_EQ(2, ast->nodes[2]->position);
+  EXPECT_EQ(ast, ast->nodes[2]->parent.lock());
+
+  // The children are in the arena, which the root keeps alive.
+  EXPECT_NE(nullptr, ast->nodes.get_allocator().arena_);
+  EXPECT_NE(nullptr, ast->nodes[2]->nodes.get_allocator().arena_);
+  auto root = ast;
+  ast.reset();
+  EXPECT_EQ("TEXT", root->nodes[3]->name);
+  EXPECT_EQ(4, root->nodes[3]->position);
+  EXPECT_EQ("_", root->nodes[3]->nodes[0]->name);
+
+  auto opt = parser.optimize_ast(root);
+  root.reset();
+  EXPECT_EQ(nullptr, opt->nodes.get_allocator().arena_);
+  EXPECT_EQ(4, opt->nodes.size());
+  EXPECT_EQ("TEXT", opt->nodes[3]->original_name);
+}
+
+TEST(GeneralTest, AST_rule_id_test) {
+  using namespace udl;
+
+  parser parser(R"(
+        ROOT <- _ ITEM*
+        ITEM <- TEXT / '(' ITEM ')' _
+        TEXT <- < [a-z]+ > _
+        ~_   <- [ \t\r\n]*
+    )");
+
+  // The ids are dense and in name order.
+  auto size = parser.get_grammar().size();
+  EXPECT_LT(parser["ITEM"].rule_id, parser["ROOT"].rule_id);
+  EXPECT_LT(parser["ROOT"].rule_id, parser["TEXT"].rule_id);
+  EXPECT_LT(parser["TEXT"].rule_id, parser["_"].rule_id);
+  EXPECT_EQ(size - 1, parser["_"].rule_id);
+  EXPECT_EQ("ITEM"_, parser["ITEM"].tag);
+
+  parser.enable_ast();
+  std::shared_ptr<Ast> ast;
+  EXPECT_TRUE(parser.parse("a (b)", ast));
+
+  const auto &item = *ast->nodes[1];
+  EXPECT_EQ("ITEM"_, item.tag);
+  EXPECT_EQ(parser["ITEM"].rule_id, item.rule_id);
+  EXPECT_EQ(parser["TEXT"].rule_id, item.nodes[0]->nodes[0]->rule_id);
+
+  ast = parser.optimize_ast(ast);
+  const auto &text = *ast->nodes[0];
+  EXPECT_EQ("TEXT"_, text.tag);
+  EXPECT_EQ("ITEM"_, text.original_tag);
+  EXPECT_EQ(parser["TEXT"].rule_id, text.rule_id);
+  EXPECT_EQ(parser["ITEM"].rule_id, text.original_rule_id);
+}
+
+TEST(GeneralTest, AST_line_info_test) {
+  parser parser(R"(
+        ROOT <- _ ITEM*
+        ITEM <- TEXT / '(' _ ITEM* ')' _
+        TEXT <- < [a-z]+ > _
+        ~_   <- [ \t\r\n]*
+    )");
+  parser.enable_ast();
+
+  auto input = "a (b\n  (c\nd) e)\n f";
+  std::shared_ptr<Ast> ast;
+  EXPECT_TRUE(parser.parse(input, ast, "test.txt"));
+
+  std::function<void(const Ast &)> check = [&](const Ast &node) {
+    EXPECT_EQ(ast->line_index, node.line_index);
+    EXPECT_EQ(line_info(input, input + node.position), node.line_info());
+    for (const auto &child : node.nodes) {
+      check(*child);
+    }
+  };
+  check(*ast);
+  EXPECT_EQ("test.txt", ast->nodes[1]->path());
+
+  // The lines are known without the text after the parse.
+  std::string text = "a\nb\n c";
+  EXPECT_TRUE(parser.parse(text, ast));
+  text.assign(text.size(), '\n');
+  EXPECT_EQ(3, ast->nodes.size());
+  EXPECT_EQ(2, ast->nodes[1]->line());
+  EXPECT_EQ(3, ast->nodes[2]->line());
+  EXPECT_EQ(2, ast->nodes[2]->column());
+
+  Ast node("test.txt", 3, 5, "TEXT", std::string_view("x"), 10, 1);
+  EXPECT_EQ(3, node.line());
+  EXPECT_EQ(5, node.column());
+
+  // Nodes made one after another share an index.
+  Ast node2("test.txt", 4, 1, "TEXT", std::string_view("y"), 20, 1);
+  EXPECT_EQ(node.line_index, node2.line_index);
+  EXPECT_EQ(4, node2.line());
+  EXPECT_EQ(1, node2.column());
+  EXPECT_EQ(3, node.line());
+  EXPECT_EQ(5, node.column());
+
+  // A position at another place needs another index.
+  Ast node3("test.txt", 5, 1, "TEXT", std::string_view("z"), 10, 1);
+  EXPECT_NE(node.line_index, node3.line_index);
+  EXPECT_EQ(5, node3.line());
+  EXPECT_EQ(3, node.line());
+}
+
 TEST(GeneralTest, Backtracking_test) {
   parser parser(R"(
        START <- PAT1 / PAT2
@@ -494,6 +612,65 @@ TEST(GeneralTest, Ignore_case_negate_character_class_test) {
   EXPECT_FALSE(parser.parse("ABC"));
 }
 
+TEST(GeneralTest, Character_class_ranges_test) {
+  parser pg1(R"(ROOT <-  [_0-9a-fA-F\u00e0-\u00ff\u3000-\u30ff\u3042]+)");
+
+  EXPECT_TRUE(pg1.parse("deadBEEF_09"));
+  EXPECT_TRUE(pg1.parse(u8"\u00e0\u00ff\u3042\u30a2"));
+  EXPECT_FALSE(pg1.parse("g"));
+  EXPECT_FALSE(pg1.parse(u8"\u00df"));
+  EXPECT_FALSE(pg1.parse(u8"\u3100"));
+
+  parser pg2(R"(ROOT <-  [^\u3000-\u30ff]+)");
+  EXPECT_TRUE(pg2.parse(u8"a\u00e0\u2fff"));
+  EXPECT_FALSE(pg2.parse(u8"a\u3042"));
+}
+
+TEST(GeneralTest, Choice_first_character_dispatch_test) {
+  parser pg(R"(
+    START  <- ITEM+
+    ITEM   <- IF / WHILE / NUMBER / WORD
+    IF     <- 'if' ' '
+    WHILE  <- 'while'i ' '
+    NUMBER <- [0-9]+ ' '
+    WORD   <- [a-z]+ ' '
+  )");
+
+  std::vector<size_t> choices;
+  pg["ITEM"] = [&](const SemanticValues &vs) {
+    choices.push_back(vs.choice());
+  };
+
+  EXPECT_TRUE(pg.parse("if WHILE 12 iffy "));
+  EXPECT_EQ((std::vector<size_t>{0, 1, 2, 3}), choices);
+
+  EXPECT_FALSE(pg.parse("if WHILE 12 ? "));
+
+  size_t col = 0;
+  pg.set_logger([&](size_t, size_t c, const std::string &) { col = c; });
+  EXPECT_FALSE(pg.parse("if WHILE 12 ? "));
+  EXPECT_EQ(13, col);
+
+  // A handler set after the first parse still sees the rule tried at each
+  // item and at the end, with the operators and with the lowered rules.
+  for (auto lower : {false, true}) {
+    parser pg2(R"(
+      START  <- ITEM+
+      ITEM   <- IF / WORD
+      IF     <- 'if' ' '
+      WORD   <- [a-z]+ ' '
+    )");
+    if (lower) { EXPECT_LT(0, pg2.lower_grammar()); }
+    EXPECT_TRUE(pg2.parse("x "));
+
+    size_t count = 0;
+    pg2["IF"].enter = [&](const Context & /*c*/, const char *, size_t,
+                          std::any &) { count++; };
+    EXPECT_TRUE(pg2.parse("x y "));
+    EXPECT_EQ(3, count);
+  }
+}
+
 TEST(GeneralTest, mutable_lambda_test) {
   std::vector<std::string_view> vec;
 
@@ -752,6 +929,35 @@ TEST(GeneralTest, Calculator_test_with_AST) {
   EXPECT_EQ(-3, val);
 }
 
+TEST(GeneralTest, Optimized_AST_test) {
+  auto grammar = R"(
+        EXPRESSION       <-  _ TERM (TERM_OPERATOR TERM)*
+        TERM             <-  FACTOR (FACTOR_OPERATOR FACTOR)*
+        FACTOR           <-  NUMBER / '(' _ EXPRESSION ')' _ { no_ast_opt }
+        TERM_OPERATOR    <-  < [-+] > _
+        FACTOR_OPERATOR  <-  < [/*] > _
+        NUMBER           <-  < [0-9]+ > _
+        ~_               <-  [ \t\r\n]*
+    )";
+  auto input = "1+2*3*(4-5+6)/7-(8)";
+
+  for (auto opt_mode : {true, false}) {
+    parser pg1(grammar);
+    pg1.enable_ast();
+    std::shared_ptr<Ast> ast1;
+    EXPECT_TRUE(pg1.parse(input, ast1));
+    ast1 = pg1.optimize_ast(ast1, opt_mode);
+
+    parser pg2(grammar);
+    pg2.enable_optimized_ast(opt_mode);
+    std::shared_ptr<Ast> ast2;
+    EXPECT_TRUE(pg2.parse(input, ast2));
+
+    EXPECT_EQ(ast_to_s(ast1), ast_to_s(ast2));
+    EXPECT_EQ(ast2, ast2->nodes[1]->parent.lock());
+  }
+}
+
 TEST(GeneralTest, Calculator_test_with_combinators_and_AST) {
   // Construct grammer
   AST_DEFINITIONS(EXPRESSION, TERM, FACTOR, TERM_OPERATOR, FACTOR_OPERATOR,
@@ -1,6 +1,10 @@
 ﻿#include <gtest/gtest.h>
 #include <peglib.h>
+#include <fstream>
 #include <sstream>
+#include <thread>
+
+#include "expr_grammar.h"
 
 using namespace peg;
 
@@ -243,6 +247,34 @@ TEST(InfiniteLoopTest, in_prioritized_choice) {
   EXPECT_FALSE(pg);
 }
 
+TEST(PerformanceLintTest, Report_performance) {
+  parser parser(R"(
+    S     <- A+
+    A     <- B 'x' / B 'y' / 'z' _
+    B     <- DIGIT+ ('a' / 'b' / [c-d])*
+    C     <- [a-z] / [x-z0-9]
+    DIGIT <- [0-9]
+    ~_    <- [ ]*
+    %whitespace <- [ \t]*
+  )");
+
+  std::vector<std::string> msgs;
+  parser.report_performance(
+      [&](size_t ln, size_t, const std::string &msg, const std::string &) {
+        msgs.push_back(std::to_string(ln) + ": " + msg);
+      });
+
+  ASSERT_EQ(5, msgs.size());
+  EXPECT_EQ(0, msgs[0].find("3: 'A': 'B' is parsed again"));
+  EXPECT_EQ("3: 'A': '_' skips whitespace right after %whitespace did.",
+            msgs[1]);
+  EXPECT_EQ(0, msgs[2].find("4: 'B': a repetition of 'DIGIT'"));
+  EXPECT_EQ(0, msgs[3].find("4: 'B': a repetition of a choice of single"));
+  EXPECT_EQ("5: 'C': alternatives 1 and 2 of a choice can both start with "
+            "'x', so the input is backtracked.",
+            msgs[4]);
+}
+
 TEST(PrecedenceTest, Precedence_climbing) {
   parser parser(R"(
         START            <-  _ EXPRESSION
@@ -304,6 +336,367 @@ TEST(PrecedenceTest, Precedence_climbing) {
   }
 }
 
+TEST(PrecedenceTest, Precedence_climbing_in_threads) {
+  parser parser(R"(
+        EXPRESSION  <-  ATOM (OPERATOR ATOM)* {
+                          precedence
+                            L + -
+                            L * /
+                        }
+        ATOM        <-  NUMBER / '(' EXPRESSION ')'
+        OPERATOR    <-  < [-+*/] >
+        NUMBER      <-  < '-'? [0-9]+ >
+        %whitespace <-  [ \t]*
+        %word       <-  [0-9]
+	)");
+
+  parser["EXPRESSION"] = [](const SemanticValues &vs) -> long {
+    auto result = std::any_cast<long>(vs[0]);
+    if (vs.size() > 1) {
+      auto ope = std::any_cast<char>(vs[1]);
+      auto num = std::any_cast<long>(vs[2]);
+      switch (ope) {
+      case '+': result += num; break;
+      case '-': result -= num; break;
+      case '*': result *= num; break;
+      case '/': result /= num; break;
+      }
+    }
+    return result;
+  };
+  parser["OPERATOR"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
+  parser["NUMBER"] = [](const SemanticValues &vs) {
+    return vs.token_to_number<long>();
+  };
+
+  parser.enable_packrat_parsing();
+  parser.freeze();
+
+  std::vector<std::thread> threads;
+  std::vector<size_t> failures(4);
+  for (size_t t = 0; t < failures.size(); t++) {
+    threads.emplace_back([&, t]() {
+      for (auto i = 0; i < 200; i++) {
+        long val = 0;
+        if (!parser.parse(" 1 + 2 * 3 * (4 - 5 + 6) / 7 - 8 ", val) ||
+            val != -3) {
+          failures[t]++;
+        }
+      }
+    });
+  }
+  for (auto &th : threads) {
+    th.join();
+  }
+
+  EXPECT_EQ((std::vector<size_t>{0, 0, 0, 0}), failures);
+}
+
+TEST(BatchTest, Parse_batch) {
+  parser parser(R"(
+    SUM    <- NUMBER ('+' NUMBER)*
+    NUMBER <- < [0-9]+ >
+    %whitespace <- [ ]*
+  )");
+
+  parser["SUM"] = [](const SemanticValues &vs) {
+    auto sum = 0;
+    for (const auto &v : vs) {
+      sum += std::any_cast<int>(v);
+    }
+    return sum;
+  };
+  parser["NUMBER"] = [](const SemanticValues &vs) {
+    return vs.token_to_number<int>();
+  };
+
+  std::vector<std::string> errors;
+  parser.set_logger([&](size_t ln, size_t col, const std::string &) {
+    errors.push_back(std::to_string(ln) + ":" + std::to_string(col));
+  });
+
+  std::vector<std::string_view> inputs;
+  std::vector<std::string> texts;
+  for (auto i = 0; i < 100; i++) {
+    texts.push_back(i % 10 == 9 ? std::string(i / 10, ' ') + "1 + x"
+                                : std::to_string(i) + " + 1");
+  }
+  for (const auto &text : texts) {
+    inputs.push_back(text);
+  }
+
+  std::vector<int> vals;
+  auto rets = parser.parse_batch(inputs, vals, 4);
+
+  ASSERT_EQ(inputs.size(), rets.size());
+  ASSERT_EQ(10, errors.size());
+  for (auto i = 0; i < 100; i++) {
+    if (i % 10 == 9) {
+      EXPECT_FALSE(rets[i]);
+    } else {
+      EXPECT_TRUE(rets[i]);
+      EXPECT_EQ(i + 1, vals[i]);
+    }
+  }
+  for (auto i = 0; i < 10; i++) {
+    EXPECT_EQ("1:" + std::to_string(5 + i), errors[i]);
+  }
+
+  // `std::vector<bool>` packs the values, which the threads don't touch.
+  parser["SUM"] = [](const SemanticValues &vs) { return vs.size() > 1; };
+  std::vector<bool> flags;
+  rets = parser.parse_batch(inputs, flags, 4);
+  ASSERT_EQ(inputs.size(), flags.size());
+  for (auto i = 0; i < 100; i++) {
+    EXPECT_EQ(i % 10 != 9, flags[i]);
+  }
+}
+
+TEST(BatchTest, Parse_parallel) {
+  parser parser(R"(
+    ITEMS  <- ITEM*
+    ITEM   <- NUMBER ';' / '(' [^)]* ')' ';'
+    NUMBER <- < [0-9]+ >
+    %whitespace <- [ \n]*
+  )");
+
+  parser["ITEM"] = [](const SemanticValues &vs) {
+    return vs.choice() == 0 ? std::any_cast<int>(vs[0]) : -1;
+  };
+  parser["NUMBER"] = [](const SemanticValues &vs) {
+    return vs.token_to_number<int>();
+  };
+
+  std::string text;
+  for (auto i = 0; i < 1000; i++) {
+    text += " " + std::to_string(i) + ";\n";
+  }
+
+  std::vector<int> items;
+  EXPECT_TRUE(parser.parse_parallel(text, "ITEM", ";", items, 4));
+  ASSERT_EQ(1000, items.size());
+  for (auto i = 0; i < 1000; i++) {
+    EXPECT_EQ(i, items[i]);
+  }
+
+  // A chunk starting inside the parentheses fails, so the input is parsed
+  // again sequentially.
+  EXPECT_TRUE(parser.parse_parallel("(1;2;3;4;5;6;7;8;9);", "ITEM", ";", items,
+                                    2));
+  EXPECT_EQ(std::vector<int>{-1}, items);
+
+  size_t col = 0;
+  parser.set_logger([&](size_t, size_t c, const std::string &) { col = c; });
+  EXPECT_FALSE(parser.parse_parallel("1;2;x;3;", "ITEM", ";", items, 2));
+  EXPECT_EQ(5, col);
+
+  // A chunk starting inside the comment parses, but the comment runs past
+  // the start of it, so the input is parsed again sequentially.
+  peg::parser parser2(R"(
+    ITEM   <- NUMBER ';' / '-' [^\n]* '\n'
+    NUMBER <- < [0-9]+ >
+    %whitespace <- [ \n]*
+  )");
+  parser2["ITEM"] = [](const SemanticValues &vs) {
+    return vs.choice() == 0 ? vs.token_to_number<int>() : -1;
+  };
+  EXPECT_TRUE(parser2.parse_parallel("-1;2;\n3;", "ITEM", ";", items, 2));
+  EXPECT_EQ((std::vector<int>{-1, 3}), items);
+}
+
+TEST(BatchTest, Parse_stream) {
+  parser parser(R"(
+    ITEMS  <- ITEM*
+    ITEM   <- NUMBER ';' / '(' [^)]* ')' ';'
+    NUMBER <- < [0-9]+ >
+    %whitespace <- [ \n]*
+  )");
+
+  parser["ITEM"] = [](const SemanticValues &vs) {
+    return vs.choice() == 0 ? std::any_cast<int>(vs[0]) : -1;
+  };
+  parser["NUMBER"] = [](const SemanticValues &vs) {
+    return vs.token_to_number<int>();
+  };
+
+  std::string text;
+  for (auto i = 0; i < 1000; i++) {
+    text += " " + std::to_string(i) + ";\n";
+  }
+  text += "(1;2;3);";
+
+  std::vector<int> items;
+  std::istringstream is(text);
+  EXPECT_TRUE(parser.parse_stream<int>(
+      is, "ITEM", ";", [&](int val) { items.push_back(val); }, 7));
+  ASSERT_EQ(1001, items.size());
+  for (auto i = 0; i < 1000; i++) {
+    EXPECT_EQ(i, items[i]);
+  }
+  EXPECT_EQ(-1, items.back());
+
+  size_t line = 0;
+  size_t col = 0;
+  parser.set_logger([&](size_t ln, size_t c, const std::string &) {
+    line = ln;
+    col = c;
+  });
+  std::istringstream is2("1;\n2;\n 3;x;4;");
+  items.clear();
+  EXPECT_FALSE(parser.parse_stream<int>(
+      is2, "ITEM", ";", [&](int val) { items.push_back(val); }, 4));
+  EXPECT_EQ((std::vector<int>{1, 2, 3}), items);
+  EXPECT_EQ(3, line);
+  EXPECT_EQ(4, col);
+
+  // An error before the last delimiter stops the parse without reading on.
+  std::istringstream is3("1;x;" + text);
+  items.clear();
+  EXPECT_FALSE(parser.parse_stream<int>(
+      is3, "ITEM", ";", [&](int val) { items.push_back(val); }, 8));
+  EXPECT_EQ((std::vector<int>{1}), items);
+  EXPECT_EQ(1, line);
+  EXPECT_EQ(3, col);
+  EXPECT_EQ(8, is3.tellg());
+
+  // The AST nodes find their lines in the whole stream.
+  peg::parser parser2(R"(
+    ITEMS  <- ITEM*
+    ITEM   <- NUMBER ';'
+    NUMBER <- < [0-9]+ >
+    %whitespace <- [ \n]*
+  )");
+  parser2.enable_ast();
+  std::vector<std::pair<size_t, size_t>> lines;
+  std::istringstream is4("1;\n 2; 3;\n4;");
+  EXPECT_TRUE(parser2.parse_stream<std::shared_ptr<Ast>>(
+      is4, "ITEM", ";",
+      [&](const std::shared_ptr<Ast> &ast) {
+        lines.push_back(ast->line_info());
+      },
+      3));
+  EXPECT_EQ((std::vector<std::pair<size_t, size_t>>{
+                {1, 1}, {2, 2}, {2, 5}, {3, 1}}),
+            lines);
+
+  // The lowered rules tell the items cut off by a block apart without a
+  // logger, too.
+  peg::parser parser3(R"(
+    ITEMS  <- ITEM*
+    ITEM   <- NUMBER ';' / '(' [^)]* ')' ';'
+    NUMBER <- < [0-9]+ >
+    %whitespace <- [ \n]*
+  )");
+  parser3["ITEM"] = [](const SemanticValues &) { return 0; };
+  EXPECT_LT(0, parser3.lower_grammar());
+  size_t count = 0;
+  std::istringstream is5(text);
+  EXPECT_TRUE(parser3.parse_stream<int>(
+      is5, "ITEM", ";", [&](int) { count++; }, 7));
+  EXPECT_EQ(1001, count);
+  std::istringstream is6("1;(2;x;3;");
+  EXPECT_FALSE(parser3.parse_stream<int>(
+      is6, "ITEM", ";", [&](int) { count++; }, 4));
+}
+
+TEST(BatchTest, Reparse_items) {
+  parser parser(R"(
+    ITEMS  <- ITEM*
+    ITEM   <- NAME '=' NUMBER ';'
+    NAME   <- < [a-z]+ >
+    NUMBER <- < [0-9]+ >
+    %whitespace <- [ \n]*
+  )");
+  parser.enable_ast();
+
+  std::string text = "a = 1;\nb = 2; c = 3;\nd = 4;";
+  std::vector<std::shared_ptr<Ast>> items;
+  EXPECT_TRUE(parser.parse_parallel(text, "ITEM", ";", items, 1));
+  ASSERT_EQ(4, items.size());
+  auto first = items[0];
+  auto last = items[3];
+
+  std::string new_text = "a = 1;\nb = 20\n; c = 3;\nd = 4;";
+  EXPECT_TRUE(parser.reparse_items(text.data(), new_text, "ITEM",
+                                   TextEdit{12, 0, 2}, items));
+  ASSERT_EQ(4, items.size());
+  EXPECT_EQ(first, items[0]);
+  EXPECT_EQ(last, items[3]);
+
+  EXPECT_EQ("20", items[1]->nodes[1]->token_to_string());
+  EXPECT_EQ(3, items[2]->line());
+  EXPECT_EQ(3, items[2]->column());
+  EXPECT_EQ(new_text.find('c'), items[2]->position);
+  EXPECT_EQ(4, items[3]->line());
+  EXPECT_EQ(new_text.data() + new_text.find('4'),
+            items[3]->nodes[1]->token.data());
+
+  EXPECT_FALSE(parser.reparse_items(new_text.data(), "a = 1; b = ;", "ITEM",
+                                    TextEdit{0, new_text.size(), 12}, items));
+  EXPECT_EQ(4, items.size());
+
+  // The second item, which starts after whitespace
+  text = "a = 1; b = 2;\nc = 3;";
+  EXPECT_TRUE(parser.parse_parallel(text, "ITEM", ";", items, 1));
+  first = items[0];
+  std::string text2 = "a = 1; b = 20;\nc = 3;";
+  EXPECT_TRUE(parser.reparse_items(text.data(), text2, "ITEM",
+                                   TextEdit{12, 0, 1}, items));
+  ASSERT_EQ(3, items.size());
+  EXPECT_EQ(first, items[0]);
+  EXPECT_EQ("20", items[1]->nodes[1]->token_to_string());
+  EXPECT_EQ(text2.find('b'), items[1]->position);
+
+  // An edit in place leaves the items before it alone.
+  text.reserve(64);
+  EXPECT_TRUE(parser.parse_parallel(text, "ITEM", ";", items, 1));
+  first = items[0];
+  auto line_index = first->line_index;
+  auto old_s = text.data();
+  text.insert(12, "0");
+  ASSERT_EQ(old_s, text.data());
+  EXPECT_TRUE(
+      parser.reparse_items(old_s, text, "ITEM", TextEdit{12, 0, 1}, items));
+  ASSERT_EQ(3, items.size());
+  EXPECT_EQ(first, items[0]);
+  EXPECT_EQ(line_index, items[0]->line_index);
+  EXPECT_EQ("20", items[1]->nodes[1]->token_to_string());
+  EXPECT_EQ(2, items[2]->line());
+  EXPECT_EQ(text.data() + text.find('3'), items[2]->nodes[1]->token.data());
+}
+
+TEST(FileTest, Parse_file) {
+  const char *path = "parse_file_test.txt";
+  {
+    std::ofstream ofs(path, std::ios::binary);
+    ofs << "hello world";
+  }
+
+  std::shared_ptr<Ast> word;
+  {
+    parser parser(R"(
+      START <- WORD+
+      WORD  <- < [a-z]+ >
+      %whitespace <- ' '*
+    )");
+    parser.enable_ast();
+
+    EXPECT_TRUE(parser.parse_file(path));
+
+    std::shared_ptr<Ast> ast;
+    EXPECT_TRUE(parser.parse_file(path, ast));
+    ASSERT_EQ(2, ast->nodes.size());
+    EXPECT_EQ(path, ast->path());
+    word = ast->nodes[1];
+
+    EXPECT_FALSE(parser.parse_file("no_such_file.txt", ast));
+  }
+  std::remove(path);
+
+  // The node keeps the input alive.
+  EXPECT_EQ("world", word->token);
+}
+
 TEST(PrecedenceTest, Precedence_climbing_with_literal_operator) {
   parser parser(R"(
         START            <-  _ EXPRESSION
@@ -537,6 +930,189 @@ TEST(PackratTest, Packrat_parser_test_with_precedence_expression_parser) {
   EXPECT_TRUE(ret);
 }
 
+TEST(PackratTest, Packrat_parser_test_with_cache_limit) {
+  parser parser(R"(
+        EXPRESSION  <-  TERM (TERM_OP TERM)*
+        TERM        <-  FACTOR (FACTOR_OP FACTOR)*
+        FACTOR      <-  NUMBER / '(' EXPRESSION ')'
+        TERM_OP     <-  < [-+] >
+        FACTOR_OP   <-  < [*/] >
+        NUMBER      <-  < [0-9]+ >
+        %whitespace <-  [ \t]*
+    )");
+
+  parser["EXPRESSION"] = [](const SemanticValues &vs) {
+    auto result = std::any_cast<long>(vs[0]);
+    for (size_t i = 1; i < vs.size(); i += 2) {
+      auto num = std::any_cast<long>(vs[i + 1]);
+      auto ope = std::any_cast<char>(vs[i]);
+      result = ope == '+' ? result + num : result - num;
+    }
+    return result;
+  };
+  parser["TERM"] = [](const SemanticValues &vs) {
+    auto result = std::any_cast<long>(vs[0]);
+    for (size_t i = 1; i < vs.size(); i += 2) {
+      auto num = std::any_cast<long>(vs[i + 1]);
+      auto ope = std::any_cast<char>(vs[i]);
+      result = ope == '*' ? result * num : result / num;
+    }
+    return result;
+  };
+  parser["TERM_OP"] = [](const SemanticValues &vs) { return *vs.sv().data(); };
+  parser["FACTOR_OP"] = [](const SemanticValues &vs) {
+    return *vs.sv().data();
+  };
+  parser["NUMBER"] = [](const SemanticValues &vs) {
+    return vs.token_to_number<long>();
+  };
+
+  parser.enable_packrat_parsing();
+
+  for (auto limit : {0, 1, 4}) {
+    parser.set_packrat_cache_limit(limit);
+
+    long val = 0;
+    auto ret = parser.parse(" (1 + 2) * (3 + (4 - 5)) / 2 ", val);
+    EXPECT_TRUE(ret);
+    EXPECT_EQ(3, val);
+  }
+}
+
+TEST(PackratTest, Packrat_parser_test_with_window) {
+  parser parser(R"(
+        S     <-  A+
+        A     <-  B 'x' / B 'y' / B 'z'
+        B     <-  < [a-c]+ >
+    )");
+
+  size_t count = 0;
+  parser["B"] = [&](const SemanticValues & /*vs*/) { count++; };
+
+  parser.enable_packrat_parsing();
+
+  for (auto window : {0, 1, 4, 1024}) {
+    parser.set_packrat_window(window);
+
+    count = 0;
+    auto ret = parser.parse("abczcaxbby");
+    EXPECT_TRUE(ret);
+    EXPECT_EQ(3, count);
+
+    ret = parser.parse("abcw");
+    EXPECT_FALSE(ret);
+  }
+}
+
+TEST(PackratTest, Packrat_parser_test_with_no_packrat_instruction) {
+  parser parser(R"(
+        S     <-  A+
+        A     <-  B 'x' / B 'y' / B 'z'
+        B     <-  < [a-c]+ >  { no_packrat }
+    )");
+
+  EXPECT_TRUE(parser["B"].no_packrat);
+  EXPECT_FALSE(parser["A"].no_packrat);
+
+  size_t count = 0;
+  parser["B"] = [&](const SemanticValues & /*vs*/) { count++; };
+
+  parser.enable_packrat_parsing();
+
+  auto ret = parser.parse("abczcaxbby");
+  EXPECT_TRUE(ret);
+  EXPECT_EQ(6, count);
+}
+
+TEST(PackratTest, Packrat_parser_test_with_training) {
+  parser parser(R"(
+        S     <-  A+
+        A     <-  B 'x' / B 'y' / B 'z'
+        B     <-  < [a-c]+ >
+    )");
+
+  size_t count = 0;
+  parser["B"] = [&](const SemanticValues & /*vs*/) { count++; };
+
+  parser.enable_packrat_parsing();
+
+  EXPECT_TRUE(parser.train_packrat("abczcaxbby"));
+  EXPECT_TRUE(parser["S"].no_packrat);
+  EXPECT_TRUE(parser["A"].no_packrat);
+  EXPECT_FALSE(parser["B"].no_packrat);
+
+  count = 0;
+  auto ret = parser.parse("abczcaxbby");
+  EXPECT_TRUE(ret);
+  EXPECT_EQ(3, count);
+
+  // The sample turns memoization back on, and leaves the rules it doesn't
+  // try alone.
+  peg::parser parser2(R"(
+        S     <-  A+ / C
+        A     <-  B 'x' / B 'y' / B 'z'
+        B     <-  < [a-c]+ >  { no_packrat }
+        C     <-  'c'
+    )");
+  parser2.enable_packrat_parsing();
+  parser2["C"].no_packrat = true;
+  EXPECT_TRUE(parser2.train_packrat("abczcaxbby"));
+  EXPECT_TRUE(parser2["A"].no_packrat);
+  EXPECT_FALSE(parser2["B"].no_packrat);
+  EXPECT_TRUE(parser2["C"].no_packrat);
+}
+
+TEST(PackratTest, Profile) {
+  parser parser(R"(
+        S     <-  A+
+        A     <-  B 'x' / B 'y' / B 'z'
+        B     <-  < [a-c]+ >
+    )");
+
+  parser.enable_packrat_parsing();
+  auto profile = parser.enable_profile();
+  ASSERT_TRUE(profile);
+
+  EXPECT_TRUE(parser.parse("abczcaxbby"));
+  EXPECT_TRUE(parser.parse("abczcaxbby"));
+
+  auto rules = profile->rules();
+  ASSERT_EQ(3, rules.size());
+  EXPECT_EQ("S", rules[0].name);
+  EXPECT_EQ(2, rules[0].success);
+  EXPECT_EQ("A", rules[1].name);
+  EXPECT_EQ(6, rules[1].success);
+  EXPECT_EQ(2, rules[1].fail);
+  EXPECT_EQ("B", rules[2].name);
+  EXPECT_EQ(6, rules[2].fail);
+  EXPECT_EQ(8, rules[2].packrat_misses);
+  EXPECT_EQ(10, rules[2].packrat_hits);
+  EXPECT_GE(rules[0].inclusive_ns, rules[1].inclusive_ns);
+  EXPECT_GE(rules[0].inclusive_ns, rules[0].exclusive_ns);
+
+  auto csv = profile->to_csv();
+  EXPECT_EQ(0, csv.find("name,success,fail,"));
+  EXPECT_NE(std::string::npos, profile->to_json().find("\"name\": \"B\""));
+
+  profile->clear();
+  EXPECT_EQ(0, profile->rules()[0].success);
+
+  // `A` fails after `B B` matched 2 bytes.
+  peg::parser parser2(R"(
+        S     <-  A / C
+        A     <-  B B 'x'
+        C     <-  B B
+        B     <-  < [a-c] >
+    )");
+  profile = parser2.enable_profile();
+  EXPECT_TRUE(parser2.parse("ab"));
+  rules = profile->rules();
+  EXPECT_EQ("A", rules[1].name);
+  EXPECT_EQ(1, rules[1].fail);
+  EXPECT_EQ(2, rules[1].backtracked_bytes);
+  EXPECT_EQ(4, rules[2].success);
+}
+
 TEST(BackreferenceTest, Backreference_test) {
   parser parser(R"(
         START  <- _ LQUOTE < (!RQUOTE .)* > RQUOTE _
@@ -716,6 +1292,25 @@ TEST(BackreferenceTest, Backreference_with_Option_test) {
   EXPECT_FALSE(parser.parse("branchthatiswron_branchthatiscorrect"));
 }
 
+TEST(BackreferenceTest, Heredoc_test) {
+  parser parser(R"(
+        START   <- HEREDOC+
+        HEREDOC <- '<<' $tag<[A-Z]+> '\n' (!END .)* END
+        END     <- '\n' $tag '\n'
+    )");
+
+  EXPECT_TRUE(!!parser);
+  EXPECT_TRUE(parser.parse("<<EOF\nA\nEO\nEOF\n<<END\nEOF\nEND\n"));
+  EXPECT_FALSE(parser.parse("<<EOF\nA\n<<END\nEOF\nEOF\n"));
+
+  std::string error;
+  parser.set_logger([&](size_t, size_t, const std::string &msg) {
+    if (error.empty()) { error = msg; }
+  });
+  EXPECT_FALSE(parser.parse("<<EOF\nA\nEOT\n"));
+  EXPECT_EQ(std::string::npos, error.find("EOT"));
+}
+
 TEST(RepetitionTest, Repetition_0) {
   parser parser(R"(
         START <- '(' DIGIT{3} ') ' DIGIT{3} '-' DIGIT{4}
@@ -771,6 +1366,30 @@ TEST(RepetitionTest, Repetition__2) {
   EXPECT_FALSE(parser.parse("1234"));
 }
 
+TEST(RepetitionTest, Repetition_character_class) {
+  parser parser(R"(
+        START <- [a-z_0-9\u3042]+ ' ' [^;]{3,20} ';' .*
+    )");
+
+  size_t col = 0;
+  parser.set_logger([&](size_t /*ln*/, size_t c, const std::string & /*msg*/) {
+    col = c;
+  });
+
+  EXPECT_TRUE(parser.parse("abcdefghijklmnopqrstuvwxyz_0123456789 abc;"));
+  EXPECT_TRUE(parser.parse(u8"abcdefghijklmnop\u3042q xyz;\u3044\u3046"));
+  EXPECT_TRUE(parser.parse("ab 01234567890123456789;"));
+
+  EXPECT_FALSE(parser.parse("abcdefghijklmnopqrstuvwXyz abc;"));
+  EXPECT_EQ(24, col);
+
+  EXPECT_FALSE(parser.parse("ab cd;"));
+  EXPECT_EQ(6, col);
+
+  EXPECT_FALSE(parser.parse("ab 012345678901234567890;"));
+  EXPECT_EQ(24, col);
+}
+
 TEST(LeftRecursiveTest, Left_recursive_test) {
   parser parser(R"(
         A <- A 'a'
@@ -1359,6 +1978,29 @@ TEST(MacroTest, Nested_macro_call2) {
   EXPECT_TRUE(parser.parse("#TestVal1#End"));
 }
 
+TEST(MacroTest, Macro_instances) {
+  parser parser(R"(
+        EXPRESSION       <-  _ LIST(TERM, TERM_OPERATOR)
+        TERM             <-  LIST(FACTOR, FACTOR_OPERATOR)
+        FACTOR           <-  NUMBER / T('(') EXPRESSION T(')')
+        TERM_OPERATOR    <-  T([-+])
+        FACTOR_OPERATOR  <-  T([*/])
+        NUMBER           <-  T([0-9]+)
+        ~_               <-  [ \t]*
+        LIST(I, D)       <-  I (D I)*
+        T(S)             <-  < S > _
+	)");
+
+  EXPECT_EQ(2, parser["LIST"].instances.size());
+  EXPECT_EQ(5, parser["T"].instances.size());
+
+  parser.enable_ast();
+  std::shared_ptr<Ast> ast;
+  EXPECT_TRUE(parser.parse("1 + 2 * (3 - 4)", ast));
+  EXPECT_EQ("EXPRESSION", ast->name);
+  EXPECT_EQ(3, ast->nodes.size());
+}
+
 TEST(LineInformationTest, Line_information_test) {
   parser parser(R"(
         S    <- _ (WORD _)+
@@ -1419,6 +2061,20 @@ TEST(DicTest, Dictionary) {
   EXPECT_FALSE(parser.parse("This month is ."));
 }
 
+TEST(DicTest, Dictionary_ignore_case) {
+  parser parser(R"(
+        START <- 'This month is ' MONTH '.'
+        MONTH <- 'Jan'i | 'January'i | 'feb'i | 'February'i
+	)");
+
+  EXPECT_TRUE(parser.parse("This month is jan."));
+  EXPECT_TRUE(parser.parse("This month is JANUARY."));
+  EXPECT_TRUE(parser.parse("This month is Feb."));
+  EXPECT_TRUE(parser.parse("This month is fEbRuArY."));
+  EXPECT_FALSE(parser.parse("This month is Jannuary."));
+  EXPECT_FALSE(parser.parse("This month is ."));
+}
+
 TEST(DicTest, Dictionary_invalid) {
   parser parser(R"(
         START <- 'This month is ' MONTH '.'
@@ -1455,6 +2111,42 @@ TEST(ErrorTest, Default_error_handling_1) {
   EXPECT_EQ(i, errors.size());
 }
 
+TEST(ErrorTest, Two_pass_error_reporting) {
+  parser pg(R"(
+    S <- '@' A B
+    A <- < [a-z]+ >
+    B <- 'hello' | 'world'
+    %whitespace <- [ ]*
+    %word       <- [a-z]
+  )");
+
+  EXPECT_TRUE(!!pg);
+
+  pg.enable_two_pass_error_reporting();
+
+  size_t count = 0;
+  pg["A"] = [&](const SemanticValues &) { count++; };
+
+  std::vector<std::string> errors{
+      R"(1:8: syntax error, unexpected 'typo', expecting <B>.)",
+  };
+
+  size_t i = 0;
+  pg.set_logger([&](size_t ln, size_t col, const std::string &msg) {
+    std::stringstream ss;
+    ss << ln << ":" << col << ": " << msg;
+    EXPECT_EQ(errors[i++], ss.str());
+  });
+
+  EXPECT_TRUE(pg.parse(" @ aaa hello "));
+  EXPECT_EQ(1, count);
+  EXPECT_EQ(0, i);
+
+  EXPECT_FALSE(pg.parse(" @ aaa typo "));
+  EXPECT_EQ(3, count);
+  EXPECT_EQ(i, errors.size());
+}
+
 TEST(ErrorTest, Default_error_handling_2) {
   parser pg(R"(
     S <- '@' A B
@@ -2032,3 +2724,238 @@ expr <- 'hello'
   EXPECT_EQ(i, errors.size());
 }
 
+TEST(GenerateCppTest, Generated_grammar) {
+  std::ifstream ifs(EXPR_PEG_PATH);
+  std::string grammar((std::istreambuf_iterator<char>(ifs)),
+                      std::istreambuf_iterator<char>());
+
+  parser pg1(grammar);
+  EXPECT_TRUE(!!pg1);
+  EXPECT_FALSE(pg1.generate_cpp("expr").empty());
+
+  // The test build writes `expr_grammar.h` from the same grammar file.
+  parser pg2;
+  EXPECT_TRUE(load_expr_grammar(pg2));
+
+  pg1.enable_ast();
+  pg2.enable_ast();
+
+  for (auto input :
+       {"1 + 2 * (3 - 4)", " [one, th\"ree] / [two] ", "[oneone]", "1 +",
+        "'a b' * \"c'\" - NIL", "'a\"", "[one, two", "[one two]"}) {
+    std::shared_ptr<Ast> ast1;
+    std::shared_ptr<Ast> ast2;
+    std::string log1;
+    std::string log2;
+    pg1.set_logger([&](size_t ln, size_t col, const std::string &msg) {
+      log1 += std::to_string(ln) + ":" + std::to_string(col) + ": " + msg;
+    });
+    pg2.set_logger([&](size_t ln, size_t col, const std::string &msg) {
+      log2 += std::to_string(ln) + ":" + std::to_string(col) + ": " + msg;
+    });
+    auto ret1 = pg1.parse(input, ast1);
+    auto ret2 = pg2.parse(input, ast2);
+    EXPECT_EQ(ret1, ret2) << input;
+    EXPECT_EQ(log1, log2) << input;
+    if (ret1 && ret2) { EXPECT_EQ(ast_to_s(ast1), ast_to_s(ast2)) << input; }
+  }
+
+  std::shared_ptr<Ast> ast;
+  EXPECT_TRUE(pg2.parse("'a b' * [one]", ast));
+  EXPECT_EQ("EXPR", ast->name);
+}
+
+TEST(GenerateCppTest, Generate_cpp_code) {
+  parser pg(R"(
+        ROOT <- 'a\n' [b-c]* $name<'d'> $name
+    )");
+  EXPECT_FALSE(pg.generate_cpp("test").empty());
+
+  // A grammar with a user operator can't be written out.
+  auto g = std::make_shared<Grammar>();
+  (*g)["ROOT"] <=
+      usr([](const char *, size_t n, SemanticValues &, std::any &) {
+        return n;
+      });
+  parser pu;
+  EXPECT_TRUE(pu.load_grammar(g, "ROOT", false));
+  EXPECT_TRUE(pu.generate_cpp("test").empty());
+}
+
+TEST(CompiledGrammarTest, Load_compiled) {
+  auto grammar = R"(
+        EXPR        <- ATOM (OPE ATOM)* { precedence L + - L * / }
+        ATOM        <- NUMBER / '(' EXPR ')' / LIST(NAME) / QUOTE / 'nil'i
+        OPE         <- < [-+*/] >
+        NUMBER      <- < [0-9]+ > { no_packrat }
+        LIST(X)     <- '[' X (',' X)* ']'^list_end
+        NAME        <- 'one' | 'two' | "th\"ree"
+        QUOTE       <- $q<["']> (!$q .)* $q
+        list_end    <- '' { error_message "unclosed list" }
+        %whitespace <- [ \t]*
+        %word       <- [a-z]+
+    )";
+
+  parser pg1(grammar);
+  EXPECT_TRUE(!!pg1);
+  pg1.enable_ast();
+
+  auto data = pg1.save_compiled();
+  EXPECT_EQ(0, data.find(compiled_grammar_magic));
+
+  parser pg2;
+  EXPECT_TRUE(pg2.load_compiled(data));
+  EXPECT_EQ(data, pg2.save_compiled());
+  pg2.enable_ast();
+
+  for (auto input : {"1 + 2 * (3 - 4)", " [one, th\"ree] / [two] ",
+                     "'a\"b' + \"c\" - NIL", "[oneone]", "[one", "1 +"}) {
+    std::string msg1;
+    std::string msg2;
+    pg1.set_logger([&](size_t, size_t, const std::string &msg) { msg1 = msg; });
+    pg2.set_logger([&](size_t, size_t, const std::string &msg) { msg2 = msg; });
+
+    std::shared_ptr<Ast> ast1;
+    std::shared_ptr<Ast> ast2;
+    auto ret1 = pg1.parse(input, ast1);
+    auto ret2 = pg2.parse(input, ast2);
+    EXPECT_EQ(ret1, ret2);
+    EXPECT_EQ(msg1, msg2);
+    if (ret1 && ret2) { EXPECT_EQ(ast_to_s(ast1), ast_to_s(ast2)); }
+  }
+}
+
+TEST(CompiledGrammarTest, Invalid_compiled_grammar) {
+  parser pg1(R"(S <- 'a' [b-c]* S?)");
+  auto data = pg1.save_compiled();
+
+  parser pg2;
+  for (size_t n = 0; n < data.size(); n++) {
+    EXPECT_FALSE(pg2.load_compiled(data.data(), n));
+  }
+  EXPECT_FALSE(pg2.load_compiled(data + "x"));
+  EXPECT_FALSE(pg2.load_compiled("S <- 'a'"));
+  EXPECT_TRUE(pg2.load_compiled(data));
+  EXPECT_TRUE(pg2.parse("abcca"));
+
+  parser pg3(R"(S <- 'a')");
+  pg3["S"] <= usr([](const char *, size_t, SemanticValues &, std::any &) {
+    return static_cast<size_t>(1);
+  });
+  EXPECT_TRUE(pg3.save_compiled().empty());
+
+  // A reference to a rule which isn't there.
+  parser pg4(R"(
+    S  <- 'a' XY
+    XY <- 'b'
+  )");
+  auto undefined = pg4.save_compiled();
+  undefined.replace(undefined.rfind("XY"), 2, "XZ");
+  EXPECT_FALSE(pg2.load_compiled(undefined));
+
+  // A macro called without its arguments.
+  parser pg5(R"(
+    S    <- M('a')
+    M(x) <- x
+  )");
+  auto arity = pg5.save_compiled();
+  auto pos = arity.find("\x01M\x01\x01");
+  ASSERT_NE(std::string::npos, pos);
+  arity[pos + 2] = '\0';
+  EXPECT_FALSE(pg2.load_compiled(arity));
+
+  // Operators nested too deep to read them without overflowing the stack.
+  parser pg6(R"(S <- 'a')");
+  auto nested = pg6.save_compiled();
+  pos = nested.find("\x07\x00\x01\x61");
+  ASSERT_NE(std::string::npos, pos);
+  auto shallow = nested;
+  shallow.insert(pos, 100, '\x0e');
+  EXPECT_TRUE(pg2.load_compiled(shallow));
+  EXPECT_TRUE(pg2.parse("a"));
+  nested.insert(pos, 1000000, '\x0e');
+  EXPECT_FALSE(pg2.load_compiled(nested));
+}
+
+TEST(LoweringTest, Lower_grammar) {
+  auto grammar = R"(
+        CONFIG      <- ITEM (',' ITEM)* ';'?
+        ITEM        <- KEY '=' VALUE / ~FLAG KEY
+        KEY         <- < [a-z_] [a-z0-9_]* >
+        VALUE       <- SIZE / NUMBER / STRING / BOOL / PAIRS / LIST
+        SIZE        <- < [0-9]+ > UNIT
+        UNIT        <- 'kb' | 'mb'
+        NUMBER      <- < '-'? [0-9]+ ('.' [0-9]+)? >
+        STRING      <- '"' < (!'"' .)* > '"'
+        BOOL        <- 'yes'i / 'no'i
+        PAIRS       <- < ('AB'){2,3} >
+        LIST        <- '[' (VALUE (',' VALUE)*)? ']'
+        FLAG        <- '!' &[a-z]
+        %whitespace <- [ \t\n]*
+        %word       <- [a-z]+
+    )";
+
+  parser pg1(grammar);
+  parser pg2(grammar);
+  EXPECT_EQ(14, pg2.lower_grammar());
+
+  pg1.enable_ast();
+  pg2.enable_ast();
+
+  for (auto input :
+       {"a = 1, b = -2.5, c = \"x y\"", "d = YES, !e, f = [1, [no], \"]\"]",
+        "g = 10 kb, h = 1mb", "h = 10kbx", "i = ABAB, j = ABABAB;",
+        "k = ABABABAB",
+        "l = [1, 2", "!1", "m = yesno", ""}) {
+    std::shared_ptr<Ast> ast1;
+    std::shared_ptr<Ast> ast2;
+    auto ret1 = pg1.parse(input, ast1);
+    auto ret2 = pg2.parse(input, ast2);
+    EXPECT_EQ(ret1, ret2) << input;
+    if (ret1 && ret2) { EXPECT_EQ(ast_to_s(ast1), ast_to_s(ast2)) << input; }
+  }
+
+  // The rules are parsed by the operators with a logger.
+  std::string msg1;
+  std::string msg2;
+  pg1.set_logger([&](size_t, size_t, const std::string &msg) { msg1 = msg; });
+  pg2.set_logger([&](size_t, size_t, const std::string &msg) { msg2 = msg; });
+  EXPECT_FALSE(pg1.parse("a = [1, 2"));
+  EXPECT_FALSE(pg2.parse("a = [1, 2"));
+  EXPECT_EQ(msg1, msg2);
+}
+
+TEST(LoweringTest, Rules_left_to_the_operators) {
+  auto grammar = R"(
+        EXPR        <- ATOM (OPE ATOM)* { precedence L + - L * / }
+        ATOM        <- NUMBER / '(' EXPR ')' / LIST(NAME) / QUOTE / 'nil'i
+        OPE         <- < [-+*/] >
+        NUMBER      <- < [0-9]+ >
+        LIST(X)     <- '[' X (',' X)* ']'^list_end
+        NAME        <- 'one' | 'two' | "th\"ree"
+        QUOTE       <- $q<["']> (!$q .)* $q
+        list_end    <- '' { error_message "unclosed list" }
+        %whitespace <- [ \t]*
+        %word       <- [a-z]+
+    )";
+
+  parser pg1(grammar);
+  parser pg2(grammar);
+
+  // EXPR has precedence climbing, ATOM calls a macro, LIST is a macro and
+  // QUOTE has captures.
+  EXPECT_EQ(6, pg2.lower_grammar());
+
+  pg1.enable_ast();
+  pg2.enable_ast();
+
+  for (auto input : {"1 + 2 * (3 - 4)", " [one, th\"ree] / [two] ",
+                     "'a\"b' + \"c\" - NIL", "[oneone]", "[one", "1 +"}) {
+    std::shared_ptr<Ast> ast1;
+    std::shared_ptr<Ast> ast2;
+    auto ret1 = pg1.parse(input, ast1);
+    auto ret2 = pg2.parse(input, ast2);
+    EXPECT_EQ(ret1, ret2) << input;
+    if (ret1 && ret2) { EXPECT_EQ(ast_to_s(ast1), ast_to_s(ast2)) << input; }
+  }
+}